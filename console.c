@@ -4,15 +4,25 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "dudect/cpucycles.h"
+#include "histogram.h"
 #include "report.h"
+
+/* Memory statistics come from the test harness */
+#define INTERNAL 1
+#include "harness.h"
+
 #include "ttt/ttt.h"
 #include "web.h"
 
@@ -21,6 +31,25 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Open-addressed hash table indexing a list by name, with linear probing.
+ * The capacity is a power of two kept at least twice the count.
+ */
+typedef struct {
+    const char *name;
+    void *item;
+} name_slot_t;
+
+typedef struct {
+    name_slot_t *slots;
+    size_t mask;
+    size_t count;
+} name_table_t;
+
+#define NAME_TABLE_MIN 64
+
+static name_table_t cmd_table;
+static name_table_t param_table;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -30,6 +59,9 @@ static bool block_timing = false;
 /* Time of day */
 static double first_time, last_time;
 
+/* Listening socket of the web server, once started */
+static int web_fd;
+
 /* Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
  */
@@ -40,6 +72,13 @@ typedef struct __rio {
     int fd;                /* File descriptor */
     int count;             /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
+    char *map;             /* Whole file if it could be mapped, else NULL */
+    size_t map_size;       /* Length of the mapping */
+    size_t map_pos;        /* Offset of the next unread line in map */
+    cmd_element_t **cmds;  /* Commands of a compiled trace, else NULL */
+    char **cmd_names;      /* Their names */
+    size_t ncmds;          /* Number of entries in the names table */
+    size_t arg_bytes;      /* Most bytes of arguments in one record */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
     struct __rio *prev;    /* Next element in stack */
 } rio_t;
@@ -59,6 +98,19 @@ static bool quit_flag = false;
 static char *prompt = "cmd> ";
 static bool has_infile = false;
 
+/* Destination of the memory report written at exit */
+static FILE *memstat_file = NULL;
+
+/* Per-command samples recorded by the profile mode */
+typedef struct __cmd_profile {
+    histogram_t cycles;
+    histogram_t ns;
+    size_t allocs;
+    size_t frees;
+} cmd_profile_t;
+
+static bool profiling = false;
+
 /* Optional function to call as part of exit process */
 /* Maximum number of quit functions */
 
@@ -73,6 +125,65 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a */
+static size_t hash_name(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *) name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void *table_find(const name_table_t *t, const char *name)
+{
+    if (!t->slots)
+        return NULL;
+    for (size_t i = hash_name(name) & t->mask; t->slots[i].name;
+         i = (i + 1) & t->mask) {
+        if (!strcmp(t->slots[i].name, name))
+            return t->slots[i].item;
+    }
+    return NULL;
+}
+
+static void table_free(name_table_t *t)
+{
+    if (t->slots)
+        free_array(t->slots, t->mask + 1, sizeof(name_slot_t));
+    t->slots = NULL;
+    t->mask = 0;
+    t->count = 0;
+}
+
+/* Add item under name, replacing an item of the same name */
+static void table_insert(name_table_t *t, const char *name, void *item)
+{
+    if (!t->slots || 2 * (t->count + 1) > t->mask + 1) {
+        size_t cap = t->slots ? 2 * (t->mask + 1) : NAME_TABLE_MIN;
+        name_table_t grown = {
+            .slots = calloc_or_fail(cap, sizeof(name_slot_t), "table_insert"),
+            .mask = cap - 1,
+        };
+        for (size_t i = 0; t->slots && i <= t->mask; i++) {
+            if (t->slots[i].name)
+                table_insert(&grown, t->slots[i].name, t->slots[i].item);
+        }
+        table_free(t);
+        *t = grown;
+    }
+
+    size_t i = hash_name(name) & t->mask;
+    while (t->slots[i].name && strcmp(t->slots[i].name, name))
+        i = (i + 1) & t->mask;
+    if (!t->slots[i].name) {
+        t->slots[i].name = name;
+        t->count++;
+    }
+    t->slots[i].item = item;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
 {
@@ -88,8 +199,14 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->calls = 0;
+    cmd->alloc_bytes = 0;
+    cmd->free_bytes = 0;
+    cmd->peak_bytes = 0;
+    cmd->profile = NULL;
     cmd->next = next_cmd;
     *last_loc = cmd;
+    table_insert(&cmd_table, name, cmd);
 }
 
 /* Add a new parameter */
@@ -110,26 +227,72 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+    table_insert(&param_table, name, param);
+}
+
+/* Words of the current command line, and the array pointing at them.  Both
+ * are reused for every line and only grow.
+ */
+static char *arg_buf = NULL;
+static size_t arg_buf_size = 0;
+static char **arg_vec = NULL;
+static int arg_vec_cnt = 0;
+
+static void free_args()
+{
+    if (arg_buf)
+        free_block(arg_buf, arg_buf_size);
+    if (arg_vec)
+        free_array(arg_vec, arg_vec_cnt, sizeof(char *));
+    arg_buf = NULL;
+    arg_buf_size = 0;
+    arg_vec = NULL;
+    arg_vec_cnt = 0;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Make room for at least cnt arguments */
+static void grow_args(int cnt)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
+    int new_cnt = arg_vec_cnt ? 2 * arg_vec_cnt : 16;
+    while (new_cnt < cnt)
+        new_cnt *= 2;
+
+    char **vec = calloc_or_fail(new_cnt, sizeof(char *), "parse_args");
+    if (arg_vec) {
+        memcpy(vec, arg_vec, arg_vec_cnt * sizeof(char *));
+        free_array(arg_vec, arg_vec_cnt, sizeof(char *));
+    }
+    arg_vec = vec;
+    arg_vec_cnt = new_cnt;
+}
 
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+/* Make room for at least size bytes of words */
+static void reserve_arg_buf(size_t size)
+{
+    if (size <= arg_buf_size)
+        return;
+    if (size < RIO_BUFSIZE)
+        size = RIO_BUFSIZE;
+    if (arg_buf)
+        free_block(arg_buf, arg_buf_size);
+    arg_buf = malloc_or_fail(size, "parse_args");
+    arg_buf_size = size;
+}
 
-    char *src = line;
-    char *dst = buf;
+/* Parse the len bytes at line into a command line.  The words are copied
+ * into arg_buf, each null-terminated, so the line itself is left untouched
+ * and need not be terminated.  The result is only valid until the next call.
+ */
+static char **parse_args(const char *line, size_t len, int *argcp)
+{
+    reserve_arg_buf(len + 1);
+
+    const char *src = line, *end = line + len;
+    char *dst = arg_buf;
     bool skipping = true;
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
+    while (src < end) {
+        int c = (unsigned char) *src++;
         if (isspace(c)) {
             if (!skipping) {
                 /* Hit end of word */
@@ -139,24 +302,80 @@ static char **parse_args(char *line, int *argcp)
         } else {
             if (skipping) {
                 /* Hit start of new word */
-                argc++;
+                if (argc == arg_vec_cnt)
+                    grow_args(argc + 1);
+                arg_vec[argc++] = dst;
                 skipping = false;
             }
             *dst++ = c;
         }
     }
+    *dst = '\0';
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+    *argcp = argc;
+    return arg_vec;
+}
+
+/* Wall-clock time in nanoseconds, for profiling */
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Add one invocation of cmd to its profile */
+static void profile_record(cmd_element_t *cmd,
+                           int64_t cycles,
+                           int64_t ns,
+                           const alloc_stats_t *before,
+                           const alloc_stats_t *after)
+{
+    cmd_profile_t *prof = cmd->profile;
+    if (!prof) {
+        prof = malloc_or_fail(sizeof(cmd_profile_t), "profile_record");
+        hist_reset(&prof->cycles);
+        hist_reset(&prof->ns);
+        prof->allocs = 0;
+        prof->frees = 0;
+        cmd->profile = prof;
     }
 
-    free_block(buf, len + 1);
-    *argcp = argc;
-    return argv;
+    hist_record(&prof->cycles, cycles > 0 ? cycles : 0);
+    hist_record(&prof->ns, ns > 0 ? ns : 0);
+    prof->allocs += after->alloc_cnt - before->alloc_cnt;
+    prof->frees += after->free_cnt - before->free_cnt;
+}
+
+static void profile_clear()
+{
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        if (c->profile) {
+            free_block(c->profile, sizeof(cmd_profile_t));
+            c->profile = NULL;
+        }
+    }
+}
+
+static void profile_show()
+{
+    report(1, "  %-12s%8s%12s%12s%12s%12s%12s%12s%9s%9s", "Command", "Calls",
+           "min cyc", "avg cyc", "p99 cyc", "min ns", "avg ns", "p99 ns",
+           "allocs", "frees");
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        const cmd_profile_t *prof = c->profile;
+        if (!prof)
+            continue;
+        unsigned long long n = prof->cycles.count;
+        report(1,
+               "  %-12s%8llu%12llu%12.0f%12llu%12llu%12.0f%12llu%9.1f%9.1f",
+               c->name, n, (unsigned long long) prof->cycles.min,
+               hist_mean(&prof->cycles),
+               (unsigned long long) hist_percentile(&prof->cycles, 99.0),
+               (unsigned long long) prof->ns.min, hist_mean(&prof->ns),
+               (unsigned long long) hist_percentile(&prof->ns, 99.0),
+               (double) prof->allocs / n, (double) prof->frees / n);
+    }
 }
 
 static void record_error()
@@ -168,43 +387,349 @@ static void record_error()
     }
 }
 
+cmd_element_t *find_cmd(const char *name)
+{
+    return table_find(&cmd_table, name);
+}
+
+bool run_cmd(cmd_element_t *cmd, int argc, char *argv[])
+{
+    alloc_stats_t before, after;
+    bool profiled = profiling;
+    int64_t start_ns = 0, start_cycles = 0;
+    alloc_stats(&before);
+    size_t outer_peak = alloc_stats_mark();
+    if (profiled) {
+        start_ns = now_ns();
+        start_cycles = cpucycles();
+    }
+
+    bool ok = cmd->operation(argc, argv);
+    if (!ok)
+        record_error();
+
+    /* do_quit() has released cmd */
+    if (quit_flag)
+        return ok;
+
+    if (profiled) {
+        int64_t cycles = cpucycles() - start_cycles;
+        int64_t ns = now_ns() - start_ns;
+        alloc_stats(&after);
+        profile_record(cmd, cycles, ns, &before, &after);
+    } else {
+        alloc_stats(&after);
+    }
+    alloc_stats_unmark(outer_peak);
+    cmd->calls++;
+    cmd->alloc_bytes += after.alloc_bytes - before.alloc_bytes;
+    cmd->free_bytes += after.free_bytes - before.free_bytes;
+    if (after.last_peak_bytes > cmd->peak_bytes)
+        cmd->peak_bytes = after.last_peak_bytes;
+
+    return ok;
+}
+
+/* Run cmd, which was resolved from argv[0] and is NULL if unknown */
+static bool dispatch_cmd(cmd_element_t *cmd, int argc, char *argv[])
+{
+    if (!cmd) {
+        report(1, "Unknown command '%s'", argv[0]);
+        record_error();
+        return false;
+    }
+    return run_cmd(cmd, argc, argv);
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
     if (argc == 0)
         return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
+    return dispatch_cmd(find_cmd(argv[0]), argc, argv);
+}
+
+/* Variables set by 'set' or by repeat loops, substituted for $name */
+#define MAX_VARS 64
+#define MAX_VAR_NAME 16
+#define MAX_VAR_LEN 64
+
+typedef struct {
+    char name[MAX_VAR_NAME];
+    char value[MAX_VAR_LEN];
+} var_t;
+
+static var_t vars[MAX_VARS];
+static int var_cnt = 0;
+
+/* Index of the variable called name, creating it if asked to.  Return -1 if
+ * it does not exist or cannot be created.
+ */
+static int find_var(const char *name, bool create)
+{
+    for (int i = 0; i < var_cnt; i++) {
+        if (!strcmp(vars[i].name, name))
+            return i;
+    }
+    if (!create)
+        return -1;
+    if (var_cnt == MAX_VARS) {
+        report(1, "Too many variables");
+        return -1;
+    }
+    if (!*name || strlen(name) >= MAX_VAR_NAME) {
+        report(1, "Invalid variable name '%s'", name);
+        return -1;
+    }
+    strcpy(vars[var_cnt].name, name);
+    vars[var_cnt].value[0] = '\0';
+    return var_cnt++;
+}
+
+/* Replace the $name arguments of a command line by the variable values */
+static bool subst_vars(int argc, char *argv[])
+{
+    if (argc == 0 || !strcmp(argv[0], "#"))
+        return true;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '$')
+            continue;
+        int v = find_var(argv[i] + 1, false);
+        if (v < 0) {
+            report(1, "Unknown variable '%s'", argv[i]);
+            record_error();
+            return false;
+        }
+        argv[i] = vars[v].value;
+    }
+    return true;
+}
+
+/* Statement of a repeat block, tokenized and resolved once when it is read */
+typedef struct __stmt {
+    int argc;
+    char **words;       /* Saved words of the line */
+    int *var;           /* Variable substituted for each word, or -1 */
+    char **argv;        /* Arguments of the current execution */
+    cmd_element_t *cmd; /* Resolved command, NULL if unknown */
+    struct __stmt *body; /* Statements of a nested repeat, else NULL */
+    bool is_block;
+    struct __stmt *next;
+} stmt_t;
+
+/* Repeat blocks still being read, innermost last */
+#define MAX_BLOCK_DEPTH 16
+static stmt_t *open_blocks[MAX_BLOCK_DEPTH];
+static stmt_t **open_tails[MAX_BLOCK_DEPTH];
+static int block_depth = 0;
+
+/* Variable of a word that names one not set yet when the line was read */
+#define VAR_UNRESOLVED -2
+
+static stmt_t *new_stmt(int argc, char *argv[])
+{
+    stmt_t *st = malloc_or_fail(sizeof(stmt_t), "repeat");
+    st->argc = argc;
+    st->words = calloc_or_fail(argc, sizeof(char *), "repeat");
+    st->var = calloc_or_fail(argc, sizeof(int), "repeat");
+    st->argv = calloc_or_fail(argc, sizeof(char *), "repeat");
+    for (int i = 0; i < argc; i++) {
+        st->words[i] = strsave_or_fail(argv[i], "repeat");
+        st->var[i] = -1;
+        if (i > 0 && argv[i][0] == '$' && strcmp(argv[0], "#")) {
+            int v = find_var(argv[i] + 1, false);
+            st->var[i] = v < 0 ? VAR_UNRESOLVED : v;
+        }
+    }
+    st->cmd = find_cmd(argv[0]);
+    st->body = NULL;
+    st->is_block = false;
+    st->next = NULL;
+    return st;
+}
+
+static void free_stmts(stmt_t *st)
+{
+    while (st) {
+        stmt_t *next = st->next;
+        free_stmts(st->body);
+        for (int i = 0; i < st->argc; i++)
+            free_string(st->words[i]);
+        free_array(st->words, st->argc, sizeof(char *));
+        free_array(st->var, st->argc, sizeof(int));
+        free_array(st->argv, st->argc, sizeof(char *));
+        free_block(st, sizeof(stmt_t));
+        st = next;
+    }
+}
+
+/* Check the header 'repeat N [var] {' of a block, after substitution */
+static bool parse_repeat(int argc, char *argv[], int *count, int *loop_var)
+{
+    if ((argc != 3 && argc != 4) || strcmp(argv[argc - 1], "{")) {
+        report(1, "Usage: repeat N [var] {");
+        return false;
+    }
+    if (!get_int(argv[1], count) || *count < 0) {
+        report(1, "Invalid repeat count '%s'", argv[1]);
+        return false;
+    }
+    *loop_var = -1;
+    if (argc == 4 && (*loop_var = find_var(argv[2], true)) < 0)
+        return false;
+    return true;
+}
+
+static bool run_stmts(stmt_t *st);
+
+/* Run the body of a repeat block count times */
+static bool run_repeat(stmt_t *body, int count, int loop_var)
+{
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
-    if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
-        if (!ok)
+    for (int i = 0; i < count && !quit_flag; i++) {
+        if (loop_var >= 0)
+            snprintf(vars[loop_var].value, MAX_VAR_LEN, "%d", i);
+        ok = run_stmts(body) && ok;
+    }
+    return ok;
+}
+
+/* Point the arguments of st at its words and the current variable values.
+ * Variables set after the line was read are looked up once they exist.
+ */
+static bool bind_stmt(stmt_t *st)
+{
+    for (int i = 0; i < st->argc; i++) {
+        int v = st->var[i];
+        if (v == VAR_UNRESOLVED) {
+            v = find_var(st->words[i] + 1, false);
+            if (v < 0) {
+                report(1, "Unknown variable '%s'", st->words[i]);
+                return false;
+            }
+            st->var[i] = v;
+        }
+        st->argv[i] = v < 0 ? st->words[i] : vars[v].value;
+    }
+    return true;
+}
+
+static bool run_stmts(stmt_t *st)
+{
+    bool ok = true;
+    for (; st && !quit_flag; st = st->next) {
+        if (!bind_stmt(st)) {
             record_error();
-    } else {
-        report(1, "Unknown command '%s'", argv[0]);
+            ok = false;
+            continue;
+        }
+        if (st->is_block) {
+            int count, loop_var;
+            if (!parse_repeat(st->argc, st->argv, &count, &loop_var)) {
+                record_error();
+                ok = false;
+                continue;
+            }
+            ok = run_repeat(st->body, count, loop_var) && ok;
+        } else {
+            ok = dispatch_cmd(st->cmd, st->argc, st->argv) && ok;
+        }
+    }
+    return ok;
+}
+
+/* Take a line that belongs to a repeat block being read.  Return false if it
+ * is not part of a block and must be run as usual.
+ */
+static bool block_line(int argc, char *argv[], bool *ok)
+{
+    *ok = true;
+    if (argc == 1 && !strcmp(argv[0], "}")) {
+        if (!block_depth) {
+            report(1, "Unmatched '}'");
+            record_error();
+            *ok = false;
+            return true;
+        }
+        stmt_t *block = open_blocks[--block_depth];
+        if (block_depth)
+            return true;
+
+        /* The outermost block is complete */
+        int count, loop_var;
+        if (!subst_vars(block->argc, block->argv) ||
+            !parse_repeat(block->argc, block->argv, &count, &loop_var)) {
+            record_error();
+            *ok = false;
+        } else {
+            *ok = run_repeat(block->body, count, loop_var);
+        }
+        free_stmts(block);
+        return true;
+    }
+
+    bool opens = argc > 0 && !strcmp(argv[0], "repeat") &&
+                 !strcmp(argv[argc - 1], "{");
+    if (!block_depth && !opens)
+        return false;
+    /* Comments were echoed as they were read */
+    if (argc == 0 || !strcmp(argv[0], "#"))
+        return true;
+    if (opens && block_depth == MAX_BLOCK_DEPTH) {
+        report(1, "Repeat blocks nested too deeply");
         record_error();
-        ok = false;
+        *ok = false;
+        return true;
     }
 
-    return ok;
+    stmt_t *st = new_stmt(argc, argv);
+    if (block_depth) {
+        *open_tails[block_depth - 1] = st;
+        open_tails[block_depth - 1] = &st->next;
+    } else {
+        /* The header of an outermost block is kept for its own arguments */
+        for (int i = 0; i < argc; i++)
+            st->argv[i] = st->words[i];
+    }
+    if (opens) {
+        st->is_block = true;
+        open_blocks[block_depth] = st;
+        open_tails[block_depth] = &st->body;
+        block_depth++;
+    }
+    return true;
+}
+
+/* Release blocks left open at the end of input */
+static void close_blocks()
+{
+    if (block_depth) {
+        report(1, "Unterminated repeat block");
+        free_stmts(open_blocks[0]);
+        block_depth = 0;
+    }
 }
 
-/* Execute a command from a command line */
-static bool interpret_cmd(char *cmdline)
+/* Run a command line read from input */
+static bool run_line(int argc, char *argv[], cmd_element_t *cmd)
+{
+    bool ok;
+    if (block_line(argc, argv, &ok))
+        return ok;
+    if (argc == 0 || !subst_vars(argc, argv))
+        return argc == 0;
+    return dispatch_cmd(cmd, argc, argv);
+}
+
+/* Execute a command from the len bytes of a command line */
+static bool interpret_cmd(const char *cmdline, size_t len)
 {
     if (quit_flag)
         return false;
 
     int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
-
-    return ok;
+    char **argv = parse_args(cmdline, len, &argc);
+    return run_line(argc, argv, argc ? find_cmd(argv[0]) : NULL);
 }
 
 /* Set function to be executed as part of program exit */
@@ -222,11 +747,72 @@ void set_echo(bool on)
     echo = on ? 1 : 0;
 }
 
+bool set_memstat_file(const char *file_name)
+{
+    memstat_file = fopen(file_name, "w");
+    return memstat_file != NULL;
+}
+
+/* Dump memory statistics in a line-oriented format for scripts/driver.py */
+static void write_memstat(FILE *f)
+{
+    alloc_stats_t s;
+    alloc_stats(&s);
+
+    fprintf(f, "alloc_cnt %zu\n", s.alloc_cnt);
+    fprintf(f, "free_cnt %zu\n", s.free_cnt);
+    fprintf(f, "alloc_bytes %zu\n", s.alloc_bytes);
+    fprintf(f, "free_bytes %zu\n", s.free_bytes);
+    fprintf(f, "live_bytes %zu\n", s.live_bytes);
+    fprintf(f, "peak_bytes %zu\n", s.peak_bytes);
+    for (int i = 0; i < ALLOC_CLASSES; i++) {
+        if (s.hist[i])
+            fprintf(f, "hist %zu %zu\n", alloc_class_size(i), s.hist[i]);
+    }
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        if (c->calls)
+            fprintf(f, "cmd %s %zu %zu %zu %zu\n", c->name, c->calls,
+                    c->alloc_bytes, c->free_bytes, c->peak_bytes);
+    }
+}
+
 /* Built-in commands */
 static bool do_quit(int argc, char *argv[])
 {
     cmd_element_t *c = cmd_list;
     bool ok = true;
+
+    while (buf_stack)
+        pop_file();
+
+    for (int i = 0; i < quit_helper_cnt; i++) {
+        ok = ok && quit_helpers[i](argc, argv);
+    }
+
+    /* Answer a quit that came from the web with the output of the helpers */
+    if (web_fd > 0) {
+        line_set_eventmux_callback(NULL);
+        web_close();
+        web_fd = -1;
+    }
+
+    close_blocks();
+
+    /* Queues are released by now, so leaks show up as live bytes */
+    if (memstat_file) {
+        write_memstat(memstat_file);
+        fclose(memstat_file);
+        memstat_file = NULL;
+    }
+
+    if (profiling) {
+        profile_show();
+        profiling = false;
+    }
+    profile_clear();
+
+    table_free(&cmd_table);
+    table_free(&param_table);
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
@@ -240,13 +826,6 @@ static bool do_quit(int argc, char *argv[])
         free_block(ele, sizeof(param_element_t));
     }
 
-    while (buf_stack)
-        pop_file();
-
-    for (int i = 0; i < quit_helper_cnt; i++) {
-        ok = ok && quit_helpers[i](argc, argv);
-    }
-
     quit_flag = true;
     return ok;
 }
@@ -270,6 +849,93 @@ static bool do_help(int argc, char *argv[])
     return true;
 }
 
+static bool do_mem(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    alloc_stats_t s;
+    alloc_stats(&s);
+    report(1, "Allocations: %zu blocks, %zu bytes", s.alloc_cnt,
+           s.alloc_bytes);
+    report(1, "Frees: %zu blocks, %zu bytes", s.free_cnt, s.free_bytes);
+    report(1, "Live: %zu bytes, peak: %zu bytes", s.live_bytes, s.peak_bytes);
+
+    report(1, "Size classes:");
+    for (int i = 0; i < ALLOC_CLASSES; i++) {
+        if (!s.hist[i])
+            continue;
+        if (i == ALLOC_CLASSES - 1)
+            report(1, "  >= %-10zu%zu", alloc_class_size(i), s.hist[i]);
+        else
+            report(1, "  < %-11zu%zu", alloc_class_size(i + 1), s.hist[i]);
+    }
+
+    report(1, "  %-12s%10s%14s%14s%14s", "Command", "Calls", "Allocated",
+           "Freed", "Peak");
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        if (c->calls)
+            report(1, "  %-12s%10zu%14zu%14zu%14zu", c->name, c->calls,
+                   c->alloc_bytes, c->free_bytes, c->peak_bytes);
+    }
+    return true;
+}
+
+static bool do_profile(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes at most one argument", argv[0]);
+        return false;
+    }
+
+    if (argc == 1 || !strcmp(argv[1], "show")) {
+        profile_show();
+    } else if (!strcmp(argv[1], "on")) {
+        profiling = true;
+    } else if (!strcmp(argv[1], "off")) {
+        profiling = false;
+    } else if (!strcmp(argv[1], "reset")) {
+        profile_clear();
+    } else {
+        report(1, "Unknown profile action '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+/* Blocks are taken by block_line(), so this only sees malformed headers */
+static bool do_repeat(int argc, char *argv[])
+{
+    report(1, "Usage: repeat N [var] {");
+    return false;
+}
+
+static bool do_set(int argc, char *argv[])
+{
+    if (argc == 1) {
+        for (int i = 0; i < var_cnt; i++)
+            report(1, "  %-16s%s", vars[i].name, vars[i].value);
+        return true;
+    }
+    if (argc != 3) {
+        report(1, "%s takes a name and a value", argv[0]);
+        return false;
+    }
+    if (strlen(argv[2]) >= MAX_VAR_LEN) {
+        report(1, "Value of '%s' longer than %d characters", argv[1],
+               MAX_VAR_LEN - 1);
+        return false;
+    }
+    int v = find_var(argv[1], true);
+    if (v < 0)
+        return false;
+    /* argv[2] is the value itself in 'set x $x' */
+    memmove(vars[v].value, argv[2], strlen(argv[2]) + 1);
+    return true;
+}
+
 static bool do_comment_cmd(int argc, char *argv[])
 {
     if (echo)
@@ -312,7 +978,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -321,23 +986,15 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
-        /* Didn't find parameter */
-        if (!found) {
+        param_element_t *param = table_find(&param_table, name);
+        if (!param) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *param->valp;
+        *param->valp = value;
+        if (param->setter)
+            param->setter(oldval);
     }
 
     return true;
@@ -358,6 +1015,22 @@ static bool do_source(int argc, char *argv[])
     return true;
 }
 
+/* Let traces check error paths: errors that were expected do not count */
+static bool do_expect(int argc, char *argv[])
+{
+    int n;
+    if (argc != 2 || !get_int(argv[1], &n) || n < 0) {
+        report(1, "%s takes a number of errors", argv[0]);
+        return false;
+    }
+    if (err_cnt != n) {
+        report(1, "Expected %d errors, got %d", n, err_cnt);
+        return false;
+    }
+    err_cnt = 0;
+    return true;
+}
+
 static bool do_log(int argc, char *argv[])
 {
     if (argc < 2) {
@@ -372,6 +1045,36 @@ static bool do_log(int argc, char *argv[])
     return result;
 }
 
+/* Emit a structured record for a command run under 'time' */
+static void bench_time(int argc,
+                       char *argv[],
+                       int64_t cycles,
+                       int64_t ns,
+                       const alloc_stats_t *before,
+                       const alloc_stats_t *after)
+{
+    char params[MAX_CHAR] = "";
+    size_t len = 0;
+    for (int i = 1; i < argc && len < sizeof(params) - 1; i++) {
+        int n = snprintf(params + len, sizeof(params) - len, "%s%s",
+                         i > 1 ? " " : "", argv[i]);
+        if (n < 0)
+            break;
+        len += n;
+    }
+
+    bench_record_t rec = {
+        .name = argv[0],
+        .params = params,
+        .cycles = cycles,
+        .ns = ns,
+        .allocs = after->alloc_cnt - before->alloc_cnt,
+        .frees = after->free_cnt - before->free_cnt,
+        .peak_bytes = after->last_peak_bytes,
+    };
+    report_bench(&rec);
+}
+
 static bool do_time(int argc, char *argv[])
 {
     double delta = delta_time(&last_time);
@@ -380,32 +1083,57 @@ static bool do_time(int argc, char *argv[])
         double elapsed = last_time - first_time;
         report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
     } else {
+        alloc_stats_t before, after;
+        alloc_stats(&before);
+        size_t outer_peak = alloc_stats_mark();
+        int64_t start_ns = now_ns();
+        int64_t start_cycles = cpucycles();
+
         ok = interpret_cmda(argc - 1, argv + 1);
+
+        int64_t cycles = cpucycles() - start_cycles;
+        int64_t ns = now_ns() - start_ns;
+        alloc_stats(&after);
+        alloc_stats_unmark(outer_peak);
+
         if (block_flag) {
             block_timing = true;
         } else {
             delta = delta_time(&last_time);
             report(1, "Delta time = %.3f", delta);
         }
+        if (bench_enabled())
+            bench_time(argc - 1, argv + 1, cycles, ns, &before, &after);
     }
 
     return ok;
 }
 
 static bool use_linenoise = true;
-static int web_fd;
 
 static bool do_web(int argc, char *argv[])
 {
     int port = 9999;
-    if (argc == 2) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc >= 2) {
         if (argv[1][0] >= '0' && argv[1][0] <= '9')
             port = atoi(argv[1]);
     }
+    if (argc >= 3 && (!get_int(argv[2], &threads) || threads < 1 ||
+                      threads > WEB_MAX_WORKERS)) {
+        report(1, "Invalid number of threads '%s', at most %d", argv[2],
+               WEB_MAX_WORKERS);
+        return false;
+    }
+    if (web_fd > 0) {
+        report(1, "The web server is already running");
+        return false;
+    }
 
-    web_fd = web_open(port);
+    web_fd = web_open(port, threads);
     if (web_fd > 0) {
-        printf("listen on port %d, fd is %d\n", port, web_fd);
+        printf("listen on port %d, fd is %d, %d threads\n", port, web_fd,
+               threads);
         line_set_eventmux_callback(web_eventmux);
         use_linenoise = false;
     } else {
@@ -441,6 +1169,9 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    table_free(&cmd_table);
+    table_free(&param_table);
+    var_cnt = 0;
     err_cnt = 0;
     quit_flag = false;
 
@@ -451,8 +1182,27 @@ void init_cmd()
     ADD_COMMAND(quit, "Exit program", "");
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
+    ADD_COMMAND(mem, "Show harness allocation statistics per command", "");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
-    ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(expect,
+                "Check that n errors were reported since the start or the "
+                "last check, and clear them",
+                "n");
+    ADD_COMMAND(repeat,
+                "Run the lines up to the matching '}' N times, setting "
+                "variable var to 0, 1, ... N-1. Substitute $name "
+                "anywhere by the value of a variable",
+                "N [var] {");
+    ADD_COMMAND(set, "Set variable name to value, or list variables",
+                "[name value]");
+    ADD_COMMAND(profile,
+                "Record cycles, time and allocations of every command. "
+                "Statistics are shown at exit or on demand",
+                "[on|off|show|reset]");
+    ADD_COMMAND(web,
+                "Read commands from builtin web server, with threads "
+                "accepting and parsing requests (default: online CPUs)",
+                "[port] [threads]");
     ADD_COMMAND(ttt,
                 "Start Tic-Tac-Toe in mode [mode] (default mode: 1)\n"
                 "    mode 1: human v.s. cpu\n"
@@ -470,6 +1220,183 @@ void init_cmd()
     first_time = last_time;
 }
 
+/* Compiled traces, as written by scripts/compile-trace.py, replay commands
+ * without tokenizing or looking them up.  Numbers are LEB128 varints.
+ *
+ *   header:  "QTRC" magic, version byte, number of names, and the most
+ *            bytes the arguments of one record take once formatted
+ *   names:   length and bytes of each command name
+ *   records: op, number of arguments, then the length and bytes of the
+ *            echoed line if op & TRACE_RAW, then each argument as n, which
+ *            is followed by n >> 1 bytes of string if n & TRACE_INT is
+ *            clear, or is the integer zigzag-encoded in n >> 1 if set
+ *
+ * The command of a record is names[(op >> 1) - 1], or none for a blank line
+ * when op >> 1 is 0.  A line is echoed as the command and arguments joined
+ * by single spaces unless its original text is stored.
+ */
+#define TRACE_MAGIC "QTRC"
+#define TRACE_MAGIC_LEN 4
+#define TRACE_VERSION 1
+#define TRACE_RAW 1
+#define TRACE_INT 1
+/* Most bytes an integer argument takes once formatted */
+#define TRACE_INT_LEN 12
+
+static bool trace_varint(rio_t *rio, uint32_t *v)
+{
+    uint32_t x = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (rio->map_pos == rio->map_size)
+            return false;
+        uint8_t b = rio->map[rio->map_pos++];
+        x |= (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Skip over n bytes, returning their start */
+static const char *trace_bytes(rio_t *rio, uint32_t n)
+{
+    if (rio->map_size - rio->map_pos < n)
+        return NULL;
+    const char *p = rio->map + rio->map_pos;
+    rio->map_pos += n;
+    return p;
+}
+
+/* Read the header and resolve the names table of a mapped compiled trace */
+static bool load_compiled(rio_t *rio)
+{
+    uint32_t ncmds, arg_bytes;
+
+    rio->map_pos = TRACE_MAGIC_LEN;
+    if (rio->map_pos == rio->map_size ||
+        rio->map[rio->map_pos++] != TRACE_VERSION ||
+        !trace_varint(rio, &ncmds) || !trace_varint(rio, &arg_bytes) ||
+        ncmds > rio->map_size || arg_bytes / TRACE_INT_LEN > rio->map_size)
+        return false;
+
+    /* One spare entry keeps cmds non-NULL, marking the trace as compiled */
+    rio->ncmds = ncmds;
+    rio->cmds = calloc_or_fail(ncmds + 1, sizeof(cmd_element_t *), "source");
+    rio->cmd_names = calloc_or_fail(ncmds + 1, sizeof(char *), "source");
+    for (size_t i = 0; i < ncmds; i++) {
+        uint32_t len;
+        const char *name;
+        if (!trace_varint(rio, &len) || !(name = trace_bytes(rio, len)))
+            return false;
+        char *saved = malloc_or_fail(len + 1, "source");
+        memcpy(saved, name, len);
+        saved[len] = '\0';
+        rio->cmd_names[i] = saved;
+        rio->cmds[i] = find_cmd(saved);
+    }
+    rio->arg_bytes = arg_bytes;
+    return true;
+}
+
+/* Format v in decimal at dst, returning the end of the string */
+static char *format_int(char *dst, int32_t v)
+{
+    char tmp[12];
+    int n = 0;
+    uint32_t u = v < 0 ? -(uint32_t) v : (uint32_t) v;
+
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        *dst++ = '-';
+    while (n)
+        *dst++ = tmp[--n];
+    *dst++ = '\0';
+    return dst;
+}
+
+/* Echo a decoded record the way readline() echoes a text line */
+static void echo_compiled(int argc, char *argv[], const char *raw, size_t len)
+{
+    report_noreturn(1, prompt);
+    if (raw) {
+        report_noreturn(1, "%.*s\n", (int) len, raw);
+        return;
+    }
+    for (int i = 0; i < argc; i++)
+        report_noreturn(1, "%s%s", i ? " " : "", argv[i]);
+    report_noreturn(1, "\n");
+}
+
+/* Decode and run the next record of a compiled trace.  Return false at the
+ * end of the trace or on malformed data, after closing the file.
+ */
+static bool run_compiled(rio_t *rio)
+{
+    uint32_t op, argc, rawlen = 0;
+    const char *raw = NULL;
+
+    if (rio->map_pos == rio->map_size) {
+        pop_file();
+        return false;
+    }
+    if (!trace_varint(rio, &op) || !trace_varint(rio, &argc))
+        goto bad;
+    if ((op & TRACE_RAW) &&
+        (!trace_varint(rio, &rawlen) || !(raw = trace_bytes(rio, rawlen))))
+        goto bad;
+    op >>= 1;
+    /* Every argument takes at least one byte */
+    if (op > rio->ncmds || (!op && argc) || argc > INT_MAX - 1 ||
+        argc > rio->map_size - rio->map_pos)
+        goto bad;
+
+    if (argc + 1 > (uint32_t) arg_vec_cnt)
+        grow_args(argc + 1);
+    reserve_arg_buf(rio->arg_bytes);
+    char *dst = arg_buf, *end = arg_buf + rio->arg_bytes;
+    int n = 0;
+    if (op)
+        arg_vec[n++] = rio->cmd_names[op - 1];
+    for (uint32_t i = 0; i < argc; i++) {
+        uint32_t v;
+        const char *src;
+        if (!trace_varint(rio, &v))
+            goto bad;
+        arg_vec[n++] = dst;
+        if (v & TRACE_INT) {
+            v >>= 1;
+            if (end - dst < TRACE_INT_LEN)
+                goto bad;
+            dst = format_int(dst, (int32_t) (v >> 1) ^ -(int32_t) (v & 1));
+        } else {
+            v >>= 1;
+            if ((size_t) (end - dst) <= v || !(src = trace_bytes(rio, v)))
+                goto bad;
+            memcpy(dst, src, v);
+            dst += v;
+            *dst++ = '\0';
+        }
+    }
+
+    if (echo)
+        echo_compiled(n, arg_vec, raw, rawlen);
+    if (quit_flag)
+        return true;
+    run_line(n, arg_vec, op ? rio->cmds[op - 1] : NULL);
+    return true;
+
+bad:
+    report(1, "Malformed compiled trace record at offset %zu", rio->map_pos);
+    record_error();
+    pop_file();
+    return false;
+}
+
 /* Create new buffer for named file.
  * Name == NULL for stdin.
  * Return true if successful.
@@ -488,9 +1415,35 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->count = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_size = 0;
+    rnew->map_pos = 0;
+    rnew->cmds = NULL;
+    rnew->cmd_names = NULL;
+    rnew->ncmds = 0;
+    rnew->arg_bytes = 0;
     rnew->prev = buf_stack;
+
+    /* Regular files are mapped whole, so lines are read in place */
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_size = st.st_size;
+        }
+    }
     buf_stack = rnew;
 
+    if (rnew->map && rnew->map_size >= TRACE_MAGIC_LEN &&
+        !memcmp(rnew->map, TRACE_MAGIC, TRACE_MAGIC_LEN) &&
+        !load_compiled(rnew)) {
+        report(1, "Malformed compiled trace '%s'", fname);
+        pop_file();
+        return false;
+    }
+
     return true;
 }
 
@@ -500,6 +1453,17 @@ static void pop_file()
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->cmds) {
+            size_t n = rsave->ncmds + 1;
+            for (size_t i = 0; i < rsave->ncmds; i++) {
+                if (rsave->cmd_names[i])
+                    free_string(rsave->cmd_names[i]);
+            }
+            free_array(rsave->cmds, n, sizeof(cmd_element_t *));
+            free_array(rsave->cmd_names, n, sizeof(char *));
+        }
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_size);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -511,60 +1475,82 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
- * When hit EOF, close that file and return NULL
- */
-static char *readline()
+/* Next line of a mapped file, in place */
+static const char *map_line(rio_t *rio, size_t *lenp)
 {
-    char c;
-    char *lptr = linebuf;
-
-    if (!buf_stack)
+    if (rio->map_pos >= rio->map_size)
         return NULL;
 
-    for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
-        if (buf_stack->count <= 0) {
+    const char *line = rio->map + rio->map_pos;
+    size_t left = rio->map_size - rio->map_pos;
+    const char *nl = memchr(line, '\n', left);
+    size_t len = nl ? (size_t) (nl - line) + 1 : left;
+    rio->map_pos += len;
+    *lenp = len;
+    return line;
+}
+
+/* Next line of a file read through the internal buffer, copied into linebuf.
+ * Overlong lines are split.
+ */
+static const char *buffered_line(rio_t *rio, size_t *lenp)
+{
+    size_t len = 0;
+
+    while (len < RIO_BUFSIZE - 2) {
+        if (rio->count <= 0) {
             /* Need to read from input file */
-            buf_stack->count = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
-            buf_stack->bufptr = buf_stack->buf;
-            if (buf_stack->count <= 0) {
+            rio->count = read(rio->fd, rio->buf, RIO_BUFSIZE);
+            rio->bufptr = rio->buf;
+            if (rio->count <= 0) {
                 /* Encountered EOF */
-                pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
-                return NULL;
+                rio->count = 0;
+                break;
             }
         }
 
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->count--;
-        if (c == '\n')
+        size_t n = RIO_BUFSIZE - 2 - len;
+        if (n > (size_t) rio->count)
+            n = rio->count;
+        char *nl = memchr(rio->bufptr, '\n', n);
+        if (nl)
+            n = nl - rio->bufptr + 1;
+        memcpy(linebuf + len, rio->bufptr, n);
+        len += n;
+        rio->bufptr += n;
+        rio->count -= n;
+        if (nl)
             break;
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
+    if (!len)
+        return NULL;
+    *lenp = len;
+    return linebuf;
+}
+
+/* Read command from input file, setting *lenp to its length.  The line is
+ * not null-terminated and may lack the final newline.  When hit EOF, close
+ * that file and return NULL
+ */
+static const char *readline(size_t *lenp)
+{
+    if (!buf_stack)
+        return NULL;
+
+    const char *line = buf_stack->map ? map_line(buf_stack, lenp)
+                                      : buffered_line(buf_stack, lenp);
+    if (!line) {
+        pop_file();
+        return NULL;
     }
-    *lptr++ = '\0';
 
     if (echo) {
         report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
+        report_noreturn(1, "%.*s%s", (int) *lenp, line,
+                        line[*lenp - 1] == '\n' ? "" : "\n");
     }
-
-    return linebuf;
+    return line;
 }
 
 static bool cmd_done()
@@ -581,7 +1567,6 @@ static bool cmd_done()
  * nfds should be set to the maximum file descriptor for network sockets.
  * If nfds == 0, this indicates that there is no pending network activity
  */
-int web_connfd;
 static int cmd_select(int nfds,
                       fd_set *readfds,
                       fd_set *writefds,
@@ -610,14 +1595,19 @@ static int cmd_select(int nfds,
 
         if (infd == STDIN_FILENO && prompt_flag) {
             char *cmdline = linenoise(prompt);
-            if (cmdline)
-                interpret_cmd(cmdline);
+            if (cmdline) {
+                interpret_cmd(cmdline, strlen(cmdline));
+                line_free(cmdline);
+            }
             fflush(stdout);
             prompt_flag = true;
+        } else if (buf_stack->cmds) {
+            run_compiled(buf_stack);
         } else if (infd != STDIN_FILENO) {
-            char *cmdline = readline();
+            size_t len;
+            const char *cmdline = readline(&len);
             if (cmdline)
-                interpret_cmd(cmdline);
+                interpret_cmd(cmdline, len);
         }
     }
     return 0;
@@ -628,6 +1618,8 @@ bool finish_cmd()
     bool ok = true;
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
+    /* Not in do_quit(), whose caller may still hold argv in these buffers */
+    free_args();
     has_infile = false;
     return ok && err_cnt == 0;
 }
@@ -683,7 +1675,7 @@ bool run_console(char *infile_name)
     if (!has_infile) {
         char *cmdline;
         while (use_linenoise && (cmdline = linenoise(prompt))) {
-            interpret_cmd(cmdline);
+            interpret_cmd(cmdline, strlen(cmdline));
             line_history_add(cmdline);       /* Add to the history. */
             line_history_save(HISTORY_FILE); /* Save the history on disk. */
             line_free(cmdline);
@@ -18,12 +18,19 @@ typedef bool (*cmd_func_t)(int argc, char *argv[]);
 
 /* Information about each command */
 
-/* Organized as linked list in alphabetical order */
+/* Organized as linked list in alphabetical order, indexed by a hash table */
 typedef struct __cmd_element {
     char *name;
     cmd_func_t operation;
     char *summary;
     char *param;
+    /* Harness memory usage accumulated over every invocation */
+    size_t calls;
+    size_t alloc_bytes;
+    size_t free_bytes;
+    size_t peak_bytes;
+    /* Samples gathered while profiling is on, NULL until the first one */
+    struct __cmd_profile *profile;
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -47,6 +54,17 @@ void init_cmd();
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *parameter);
 #define ADD_COMMAND(cmd, msg, param) add_cmd(#cmd, do_##cmd, msg, param)
 
+/* Look up a command once so that run_cmd() can invoke it repeatedly without
+ * resolving its name.  Return NULL if there is no such command.  The handle
+ * stays valid until the interpreter quits.
+ */
+cmd_element_t *find_cmd(const char *name);
+
+/* Run a command found by find_cmd(), with the same accounting and error
+ * counting as one read from input
+ */
+bool run_cmd(cmd_element_t *cmd, int argc, char *argv[]);
+
 /* Add a new parameter */
 void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 
@@ -59,6 +77,9 @@ void add_quit_helper(cmd_func_t qf);
 /* Turn echoing on/off */
 void set_echo(bool on);
 
+/* Write harness memory statistics to the named file when the program exits */
+bool set_memstat_file(const char *file_name);
+
 /* Complete command interpretation */
 
 /* Return true if no errors occurred */
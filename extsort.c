@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "extsort.h"
+#include "queue.h"
+
+/* Smallest read buffer of a run during the merge */
+#define MIN_RUN_BUFFER 4096
+
+/* Size of the record header holding the string length */
+#define HDR_SIZE sizeof(uint32_t)
+
+struct run {
+    off_t start, end; /* byte range in the temporary file */
+};
+
+struct cursor {
+    off_t pos, end;       /* unread part of the run in the file */
+    char *buf;            /* buffered bytes of the run */
+    size_t cap, off, len; /* buf holds [off, len) out of cap bytes */
+    const char *rec;      /* current string, not NUL-terminated */
+    uint32_t rec_len;
+    size_t run; /* index of the run, to break ties stably */
+};
+
+struct merger {
+    int fd;
+    bool descend;
+    struct cursor *cursors;
+    size_t *heap; /* indices of the cursors with a current record */
+    size_t count;
+};
+
+/* Spill the values of a sorted list to tmp, releasing its elements */
+static bool write_run(struct list_head *list, FILE *tmp)
+{
+    element_t *e, *safe;
+
+    list_for_each_entry_safe (e, safe, list, list) {
+        uint32_t len = strlen(e->value);
+        if (fwrite(&len, HDR_SIZE, 1, tmp) != 1 ||
+            fwrite(e->value, 1, len, tmp) != len)
+            return false;
+        list_del(&e->list);
+        q_release_element(e);
+    }
+    return true;
+}
+
+/* Append a run to the growing array *runs of capacity *cap */
+static bool add_run(struct run **runs, size_t *count, size_t *cap, off_t start,
+                    off_t end)
+{
+    if (*count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 16;
+        struct run *grown = malloc(new_cap * sizeof(struct run));
+        if (!grown)
+            return false;
+        if (*runs) {
+            memcpy(grown, *runs, *count * sizeof(struct run));
+            free(*runs);
+        }
+        *runs = grown;
+        *cap = new_cap;
+    }
+    (*runs)[*count].start = start;
+    (*runs)[*count].end = end;
+    (*count)++;
+    return true;
+}
+
+/* Make at least need bytes of the run available at c->buf + c->off.  Return
+ * 1 on success, 0 when the run is exhausted on a record boundary, and -1 on
+ * failure or truncated data.
+ */
+static int cursor_fill(int fd, struct cursor *c, size_t need)
+{
+    size_t avail = c->len - c->off;
+
+    if (avail >= need)
+        return 1;
+
+    if (need > c->cap) {
+        char *grown = malloc(need);
+        if (!grown)
+            return -1;
+        memcpy(grown, c->buf + c->off, avail);
+        free(c->buf);
+        c->buf = grown;
+        c->cap = need;
+    } else {
+        memmove(c->buf, c->buf + c->off, avail);
+    }
+    c->off = 0;
+    c->len = avail;
+
+    while (c->len < need) {
+        if (c->pos >= c->end)
+            return c->len ? -1 : 0;
+        size_t want = c->cap - c->len;
+        if ((off_t) want > c->end - c->pos)
+            want = c->end - c->pos;
+        ssize_t got = pread(fd, c->buf + c->len, want, c->pos);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        c->pos += got;
+        c->len += got;
+    }
+    return 1;
+}
+
+/* Load the next record of the run.  Return 1 if there is one, 0 at the end
+ * of the run and -1 on failure.
+ */
+static int cursor_next(int fd, struct cursor *c)
+{
+    uint32_t len;
+    int ret = cursor_fill(fd, c, HDR_SIZE);
+
+    if (ret <= 0)
+        return ret;
+    memcpy(&len, c->buf + c->off, HDR_SIZE);
+    if (cursor_fill(fd, c, HDR_SIZE + (size_t) len) <= 0)
+        return -1;
+    c->rec = c->buf + c->off + HDR_SIZE;
+    c->rec_len = len;
+    c->off += HDR_SIZE + len;
+    return 1;
+}
+
+/* Whether the record of cursor a goes before that of cursor b.  memcmp()
+ * compares bytes as unsigned char, like strcmp().
+ */
+static bool cursor_before(const struct merger *m, size_t a, size_t b)
+{
+    const struct cursor *ca = &m->cursors[a], *cb = &m->cursors[b];
+    size_t n = ca->rec_len < cb->rec_len ? ca->rec_len : cb->rec_len;
+    int c = memcmp(ca->rec, cb->rec, n);
+
+    if (!c)
+        c = (ca->rec_len > cb->rec_len) - (ca->rec_len < cb->rec_len);
+    if (m->descend)
+        c = -c;
+    return c < 0 || (c == 0 && ca->run < cb->run);
+}
+
+static void sift_down(struct merger *m, size_t i)
+{
+    for (;;) {
+        size_t min = i, l = 2 * i + 1, r = l + 1;
+        if (l < m->count && cursor_before(m, m->heap[l], m->heap[min]))
+            min = l;
+        if (r < m->count && cursor_before(m, m->heap[r], m->heap[min]))
+            min = r;
+        if (min == i)
+            return;
+        size_t tmp = m->heap[i];
+        m->heap[i] = m->heap[min];
+        m->heap[min] = tmp;
+        i = min;
+    }
+}
+
+/* Deliver one value, either into the queue or to the output stream */
+static bool emit(struct list_head *head,
+                 FILE *out,
+                 const struct cursor *c,
+                 char **scratch,
+                 size_t *scratch_cap)
+{
+    if (out) {
+        return fwrite(c->rec, 1, c->rec_len, out) == c->rec_len &&
+               fputc('\n', out) != EOF;
+    }
+
+    if (c->rec_len + 1 > *scratch_cap) {
+        free(*scratch);
+        *scratch_cap = c->rec_len + 1;
+        *scratch = malloc(*scratch_cap);
+        if (!*scratch) {
+            *scratch_cap = 0;
+            return false;
+        }
+    }
+    memcpy(*scratch, c->rec, c->rec_len);
+    (*scratch)[c->rec_len] = '\0';
+    return q_insert_tail(head, *scratch);
+}
+
+static bool merge_runs(struct list_head *head,
+                       bool descend,
+                       size_t budget,
+                       FILE *out,
+                       FILE *tmp,
+                       const struct run *runs,
+                       size_t nruns,
+                       extsort_stats_t *stats)
+{
+    struct merger m = {.fd = fileno(tmp), .descend = descend};
+    size_t bufsize = budget / (nruns ? nruns : 1);
+    size_t scratch_cap = 0;
+    char *scratch = NULL;
+    bool ok = false;
+
+    if (bufsize < MIN_RUN_BUFFER)
+        bufsize = MIN_RUN_BUFFER;
+
+    m.cursors = malloc(nruns * sizeof(struct cursor));
+    m.heap = malloc(nruns * sizeof(size_t));
+    if (nruns && (!m.cursors || !m.heap))
+        goto out;
+    for (size_t i = 0; i < nruns; i++) {
+        m.cursors[i] = (struct cursor){
+            .pos = runs[i].start,
+            .end = runs[i].end,
+            .run = i,
+        };
+    }
+
+    for (size_t i = 0; i < nruns; i++) {
+        struct cursor *c = &m.cursors[i];
+        c->buf = malloc(bufsize);
+        if (!c->buf)
+            goto out;
+        c->cap = bufsize;
+        int ret = cursor_next(m.fd, c);
+        if (ret < 0)
+            goto out;
+        if (ret)
+            m.heap[m.count++] = i;
+    }
+    for (size_t i = m.count / 2; i-- > 0;)
+        sift_down(&m, i);
+
+    while (m.count) {
+        struct cursor *c = &m.cursors[m.heap[0]];
+        if (!emit(head, out, c, &scratch, &scratch_cap))
+            goto out;
+        stats->elements++;
+
+        int ret = cursor_next(m.fd, c);
+        if (ret < 0)
+            goto out;
+        if (!ret)
+            m.heap[0] = m.heap[--m.count];
+        sift_down(&m, 0);
+    }
+    ok = true;
+
+out:
+    if (m.cursors) {
+        for (size_t i = 0; i < nruns; i++)
+            free(m.cursors[i].buf);
+    }
+    free(m.cursors);
+    free(m.heap);
+    free(scratch);
+    return ok;
+}
+
+bool q_ext_sort(struct list_head *head,
+                bool descend,
+                size_t budget,
+                FILE *out,
+                extsort_stats_t *stats)
+{
+    struct run *runs = NULL;
+    size_t nruns = 0, cap = 0;
+    bool ok = false;
+    FILE *tmp;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!head)
+        return false;
+    tmp = tmpfile();
+    if (!tmp)
+        return false;
+
+    /* Spill chunks of the queue that fit in the budget, keeping at least
+     * one element per chunk.
+     */
+    while (!list_empty(head)) {
+        struct list_head *last = head->next;
+        size_t bytes = 0;
+        LIST_HEAD(chunk);
+
+        for (struct list_head *node = head->next; node != head;
+             node = node->next) {
+            size_t size = sizeof(element_t) +
+                          strlen(list_entry(node, element_t, list)->value) + 1;
+            if (bytes && bytes + size > budget)
+                break;
+            bytes += size;
+            last = node;
+        }
+        list_cut_position(&chunk, head, last);
+        q_sort(&chunk, descend);
+
+        off_t start = ftello(tmp);
+        if (!write_run(&chunk, tmp)) {
+            list_splice(&chunk, head);
+            goto out;
+        }
+        if (!add_run(&runs, &nruns, &cap, start, ftello(tmp)))
+            goto out;
+    }
+    if (fflush(tmp))
+        goto out;
+
+    stats->runs = nruns;
+    stats->bytes_spilled = ftello(tmp);
+    ok = merge_runs(head, descend, budget, out, tmp, runs, nruns, stats);
+
+out:
+    free(runs);
+    fclose(tmp);
+    return ok;
+}
@@ -0,0 +1,37 @@
+#ifndef LAB0_EXTSORT_H
+#define LAB0_EXTSORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "list.h"
+
+/* External merge sort of a queue of element_t.
+ *
+ * The queue is consumed in chunks of at most the memory budget.  Each chunk
+ * is sorted with q_sort() and spilled to a temporary file as a run of
+ * length-prefixed strings, releasing its elements.  The runs are then merged
+ * with a k-way heap merge, each run read through its own buffer, a share of
+ * the budget.  The merge is stable: equal values come out in queue order.
+ */
+
+typedef struct {
+    size_t elements;      /* number of values sorted */
+    size_t runs;          /* number of runs spilled */
+    size_t bytes_spilled; /* size of the temporary file */
+} extsort_stats_t;
+
+/* Sort the queue at head in ascending or descending order, using about
+ * budget bytes for runs and read buffers.  If out is NULL, the values are
+ * inserted back into head; otherwise they are written to out, one per line,
+ * and head is left empty.  Return false on allocation or I/O failure, after
+ * which values not yet merged back are lost.
+ */
+bool q_ext_sort(struct list_head *head,
+                bool descend,
+                size_t budget,
+                FILE *out,
+                extsort_stats_t *stats);
+
+#endif /* LAB0_EXTSORT_H */
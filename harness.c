@@ -1,11 +1,14 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -30,34 +33,68 @@
 
 /* Data structures used by our code */
 
+struct __arena;
+
 /* Represent allocated blocks as doubly-linked list, with
  * next and prev pointers at beginning
  */
 typedef struct __block_element {
     struct __block_element *next, *prev;
+    struct __arena *arena; /* Arena whose list holds this block */
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Every thread allocates into its own arena, so that threads only contend
+ * when freeing blocks allocated elsewhere.  Arenas are never released: when a
+ * thread exits, its arena keeps the blocks still allocated and is handed to
+ * the next thread that starts allocating.
+ */
+typedef struct __arena {
+    pthread_mutex_t lock;
+    block_element_t *allocated;
+    size_t count;
+    bool in_use;
+    struct __arena *next;
+} arena_t;
+
+static arena_t *arenas = NULL;
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local arena_t *local_arena = NULL;
+
+/* Counters for allocation reports, readable without taking any lock */
+static atomic_size_t hist[ALLOC_CLASSES];
+static atomic_size_t alloc_cnt, free_cnt;
+static atomic_size_t alloc_bytes, free_bytes;
+static atomic_size_t live_bytes, peak_bytes, last_peak_bytes;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
-static bool cautious_mode = true;
-static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+static atomic_bool cautious_mode = true;
+static atomic_bool noallocate_mode = false;
+static atomic_bool error_occurred = false;
 
 static int time_limit = 1;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Data for managing exceptions, private to each thread */
+static _Thread_local sigjmp_buf env;
+static _Thread_local volatile sig_atomic_t jmp_ready = false;
+static _Thread_local volatile sig_atomic_t time_limited = false;
+static _Thread_local int64_t deadline;
+static _Thread_local char *error_message = "";
+
+/* The time limit is enforced by a watchdog alarm that is armed lazily and
+ * left running across guarded operations.  A tight loop of commands then
+ * pays one alarm() per time_limit seconds instead of two per command, and
+ * the handler compares the clock against the deadline of the operation in
+ * progress.
+ */
+static volatile sig_atomic_t watchdog_armed = false;
 
 /* For test_malloc and test_calloc */
 typedef enum {
@@ -74,6 +111,92 @@ static bool fail_allocation()
     return (weight < 0.01 * fail_probability);
 }
 
+/* Monotonic time in nanoseconds.  Served from the vDSO, not a system call */
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Map an allocation size onto its histogram class */
+static int alloc_class(size_t size)
+{
+    if (!size)
+        return 0;
+    int cls = sizeof(size_t) * 8 - __builtin_clzl(size);
+    return cls < ALLOC_CLASSES ? cls : ALLOC_CLASSES - 1;
+}
+
+/* Raise peak to at least val */
+static void update_peak(atomic_size_t *peak, size_t val)
+{
+    size_t old = atomic_load_explicit(peak, memory_order_relaxed);
+    while (val > old &&
+           !atomic_compare_exchange_weak_explicit(
+               peak, &old, val, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+/* Thread exit: leave the arena for somebody else */
+static void release_arena(void *arg)
+{
+    arena_t *a = arg;
+    pthread_mutex_lock(&arenas_lock);
+    a->in_use = false;
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+static void make_arena_key()
+{
+    pthread_key_create(&arena_key, release_arena);
+}
+
+/* Arena of the calling thread, adopting or creating one on first use */
+static arena_t *get_arena()
+{
+    if (local_arena)
+        return local_arena;
+
+    pthread_once(&arena_key_once, make_arena_key);
+    pthread_mutex_lock(&arenas_lock);
+    arena_t *a = arenas;
+    while (a && a->in_use)
+        a = a->next;
+    if (!a) {
+        a = calloc(1, sizeof(arena_t));
+        if (!a) {
+            pthread_mutex_unlock(&arenas_lock);
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            return NULL;
+        }
+        pthread_mutex_init(&a->lock, NULL);
+        a->next = arenas;
+        arenas = a;
+    }
+    a->in_use = true;
+    pthread_mutex_unlock(&arenas_lock);
+
+    pthread_setspecific(arena_key, a);
+    local_arena = a;
+    return a;
+}
+
+/* Is b on the allocation list of any arena? */
+static bool is_allocated(const block_element_t *b)
+{
+    bool found = false;
+    pthread_mutex_lock(&arenas_lock);
+    for (arena_t *a = arenas; a && !found; a = a->next) {
+        pthread_mutex_lock(&a->lock);
+        for (block_element_t *ab = a->allocated; ab && !found; ab = ab->next)
+            found = ab == b;
+        pthread_mutex_unlock(&a->lock);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    return found;
+}
+
 /* Find header of block, given its payload.
  * Signal error if doesn't seem like legitimate block
  */
@@ -88,13 +211,7 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!is_allocated(b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -149,6 +266,8 @@ static void *alloc(alloc_t alloc_type, size_t size)
         error_occurred = true;
     }
 
+    arena_t *a = get_arena();
+
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
@@ -156,15 +275,30 @@ static void *alloc(alloc_t alloc_type, size_t size)
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
+
+    pthread_mutex_lock(&a->lock);
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
+    new_block->arena = a;
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->next = a->allocated;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    if (a->allocated)
+        a->allocated->prev = new_block;
+    a->allocated = new_block;
+    a->count++;
+    pthread_mutex_unlock(&a->lock);
+
+    atomic_fetch_add_explicit(&hist[alloc_class(size)], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_cnt, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+    size_t live =
+        atomic_fetch_add_explicit(&live_bytes, size, memory_order_relaxed) +
+        size;
+    update_peak(&peak_bytes, live);
+    update_peak(&last_peak_bytes, live);
 
     return p;
 }
@@ -211,17 +345,26 @@ void test_free(void *p)
     memset(p, FILLCHAR, b->payload_size);
 
     /* Unlink from list */
+    arena_t *a = b->arena;
+    pthread_mutex_lock(&a->lock);
     block_element_t *bn = b->next;
     block_element_t *bp = b->prev;
     if (bp)
         bp->next = bn;
     else
-        allocated = bn;
+        a->allocated = bn;
     if (bn)
         bn->prev = bp;
+    a->count--;
+    pthread_mutex_unlock(&a->lock);
+
+    atomic_fetch_add_explicit(&free_cnt, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&free_bytes, b->payload_size,
+                              memory_order_relaxed);
+    atomic_fetch_sub_explicit(&live_bytes, b->payload_size,
+                              memory_order_relaxed);
 
     free(b);
-    allocated_count--;
 }
 
 // cppcheck-suppress unusedFunction
@@ -235,9 +378,46 @@ char *test_strdup(const char *s)
     return memcpy(new, s, len);
 }
 
+/* Merge the block counts of all arenas */
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t count = 0;
+    pthread_mutex_lock(&arenas_lock);
+    for (arena_t *a = arenas; a; a = a->next) {
+        pthread_mutex_lock(&a->lock);
+        count += a->count;
+        pthread_mutex_unlock(&a->lock);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    return count;
+}
+
+void alloc_stats(alloc_stats_t *s)
+{
+    for (int i = 0; i < ALLOC_CLASSES; i++)
+        s->hist[i] = atomic_load_explicit(&hist[i], memory_order_relaxed);
+    s->alloc_cnt = atomic_load(&alloc_cnt);
+    s->free_cnt = atomic_load(&free_cnt);
+    s->alloc_bytes = atomic_load(&alloc_bytes);
+    s->free_bytes = atomic_load(&free_bytes);
+    s->live_bytes = atomic_load(&live_bytes);
+    s->peak_bytes = atomic_load(&peak_bytes);
+    s->last_peak_bytes = atomic_load(&last_peak_bytes);
+}
+
+size_t alloc_class_size(int cls)
+{
+    return cls ? (size_t) 1 << (cls - 1) : 0;
+}
+
+size_t alloc_stats_mark()
+{
+    return atomic_exchange(&last_peak_bytes, atomic_load(&live_bytes));
+}
+
+void alloc_stats_unmark(size_t outer_peak)
+{
+    update_peak(&last_peak_bytes, outer_peak);
 }
 
 /* Implementation of functions for testing */
@@ -261,9 +441,7 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
 /* Prepare for a risky operation using setjmp.
@@ -271,13 +449,20 @@ bool error_check()
  */
 bool exception_setup(bool limit_time)
 {
-    if (sigsetjmp(env, 1)) {
-        /* Got here from longjmp */
+    /* Saving the signal mask costs a system call on every setup.  Skip it and
+     * repair the mask on the (rare) error return instead.
+     */
+    if (sigsetjmp(env, 0)) {
+        /* Got here from longjmp, possibly out of the SIGALRM handler, which
+         * leaves SIGALRM blocked.
+         */
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGALRM);
+        pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
         jmp_ready = false;
-        if (time_limited) {
-            alarm(0);
-            time_limited = false;
-        }
+        time_limited = false;
 
         if (error_message)
             report_event(MSG_ERROR, error_message);
@@ -288,8 +473,12 @@ bool exception_setup(bool limit_time)
     /* Got here from initial call */
     jmp_ready = true;
     if (limit_time) {
-        alarm(time_limit);
+        deadline = now_ns() + time_limit * 1000000000LL;
         time_limited = true;
+        if (!watchdog_armed) {
+            watchdog_armed = true;
+            alarm(time_limit);
+        }
     }
     return true;
 }
@@ -297,15 +486,32 @@ bool exception_setup(bool limit_time)
 /* Call once past risky code */
 void exception_cancel()
 {
-    if (time_limited) {
-        alarm(0);
-        time_limited = false;
-    }
-
+    time_limited = false;
     jmp_ready = false;
     error_message = "";
 }
 
+/* Check from the SIGALRM handler whether the guarded operation has run past
+ * its deadline.  If it has not, rearm the watchdog for the time remaining.
+ */
+bool time_limit_exceeded()
+{
+    if (!time_limited) {
+        /* Nothing in progress: let the watchdog rest until the next setup */
+        watchdog_armed = false;
+        return false;
+    }
+
+    int64_t remaining = deadline - now_ns();
+    if (remaining <= 0) {
+        watchdog_armed = false;
+        return true;
+    }
+
+    alarm((remaining + 999999999) / 1000000000);
+    return false;
+}
+
 /* Use longjmp to return to most recent exception setup */
 void trigger_exception(char *msg)
 {
@@ -8,6 +8,10 @@
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ *
+ * All functions may be called from multiple threads.  Each thread keeps its
+ * own list of allocated blocks and its own exception context, while counters
+ * and reports cover the whole process.
  */
 
 void *test_malloc(size_t size);
@@ -21,6 +25,39 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Number of size classes in the allocation histogram.
+ * Class 0 counts zero-byte requests, class i counts requests in the range
+ * [2^(i-1), 2^i) bytes, and the last class absorbs everything larger.
+ */
+#define ALLOC_CLASSES 24
+
+/* Statistics about the blocks handed out by test_malloc and friends */
+typedef struct {
+    size_t hist[ALLOC_CLASSES]; /* Allocations per size class */
+    size_t alloc_cnt;           /* Successful allocations */
+    size_t free_cnt;            /* Released blocks */
+    size_t alloc_bytes;         /* Payload bytes allocated so far */
+    size_t free_bytes;          /* Payload bytes released so far */
+    size_t live_bytes;          /* Payload bytes currently allocated */
+    size_t peak_bytes;          /* Maximum of live_bytes since start */
+    size_t last_peak_bytes;     /* Maximum of live_bytes since last mark */
+} alloc_stats_t;
+
+/* Take a snapshot of allocation statistics */
+void alloc_stats(alloc_stats_t *stats);
+
+/* Lower bound of the given size class, in bytes */
+size_t alloc_class_size(int cls);
+
+/* Start a new window for last_peak_bytes at the current live size.
+ * Return the peak of the enclosing window, to be passed to alloc_stats_unmark
+ * once the inner window is done, so that windows can nest.
+ */
+size_t alloc_stats_mark();
+
+/* Close the window opened by alloc_stats_mark */
+void alloc_stats_unmark(size_t outer_peak);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
@@ -40,13 +77,21 @@ void set_noallocate_mode(bool noallocate);
 bool error_check();
 
 /* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+ * Function returns true for initial return, false for error return.
+ * The time limit relies on SIGALRM, which is process-wide: threads other than
+ * the one arming it should keep SIGALRM blocked.
  */
 bool exception_setup(bool limit_time);
 
 /* Call once past risky code */
 void exception_cancel();
 
+/* To be called from the SIGALRM handler.
+ * Return true when the operation guarded by exception_setup has run out of
+ * time, in which case the handler should call trigger_exception.
+ */
+bool time_limit_exceeded();
+
 /* Use longjmp to return to most recent exception setup.  Include error message
  */
 void trigger_exception(char *msg);
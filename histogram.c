@@ -0,0 +1,60 @@
+#include <string.h>
+
+#include "histogram.h"
+
+void hist_reset(histogram_t *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_merge(histogram_t *dst, const histogram_t *src)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+double hist_mean(const histogram_t *h)
+{
+    return h->count ? (double) h->sum / h->count : 0.0;
+}
+
+/* Largest value that falls into bucket idx */
+static uint64_t bucket_top(int idx)
+{
+    if (idx < HIST_SUB_BUCKETS)
+        return idx;
+    int shift = idx / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = idx % HIST_SUB_BUCKETS;
+    return ((HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+uint64_t hist_percentile(const histogram_t *h, double p)
+{
+    if (!h->count)
+        return 0;
+
+    uint64_t rank = (uint64_t) (p / 100.0 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > h->count)
+        rank = h->count;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            if (top > h->max)
+                top = h->max;
+            return top < h->min ? h->min : top;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,63 @@
+#ifndef LAB0_HISTOGRAM_H
+#define LAB0_HISTOGRAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Log-linear histogram of 64-bit samples, in the spirit of HdrHistogram.
+ *
+ * Samples are grouped by their most significant bit, and every power-of-two
+ * range is split into HIST_SUB_BUCKETS linear sub-buckets.  Percentiles are
+ * therefore reported with a relative error below 1 / HIST_SUB_BUCKETS, while
+ * the whole 64-bit range fits in a fixed array.  Recording a sample neither
+ * allocates nor makes system calls.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min, max;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram_t;
+
+/* Index of the bucket holding value v */
+static inline int hist_index(uint64_t v)
+{
+    if (v < HIST_SUB_BUCKETS)
+        return (int) v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS +
+           (int) ((v >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Add a sample */
+static inline void hist_record(histogram_t *h, uint64_t v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* Empty the histogram */
+void hist_reset(histogram_t *h);
+
+/* Add all samples of src into dst */
+void hist_merge(histogram_t *dst, const histogram_t *src);
+
+/* Mean of the samples, 0 when empty */
+double hist_mean(const histogram_t *h);
+
+/* Smallest recorded value v such that at least p percent of the samples are
+ * less than or equal to v, up to the bucket resolution.  0 when empty.
+ */
+uint64_t hist_percentile(const histogram_t *h, double p);
+
+#endif /* LAB0_HISTOGRAM_H */
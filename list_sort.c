@@ -1,3 +1,7 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+
 #include "list_sort.h"
 /*
  * Returns a list organized in an intermediate format suited
@@ -19,6 +23,7 @@ merge(void *priv, list_cmp_func_t cmp, struct list_head *a, struct list_head *b)
                 *tail = b;
                 break;
             }
+            list_sort_prefetch(a->next);
         } else {
             *tail = b;
             tail = &b->next;
@@ -27,6 +32,7 @@ merge(void *priv, list_cmp_func_t cmp, struct list_head *a, struct list_head *b)
                 *tail = a;
                 break;
             }
+            list_sort_prefetch(b->next);
         }
     }
     return head;
@@ -57,6 +63,7 @@ __attribute__((nonnull(2, 3, 4, 5))) static void merge_final(
             a = a->next;
             if (!a)
                 break;
+            list_sort_prefetch(a->next);
         } else {
             tail->next = b;
             b->prev = tail;
@@ -66,6 +73,7 @@ __attribute__((nonnull(2, 3, 4, 5))) static void merge_final(
                 b = a;
                 break;
             }
+            list_sort_prefetch(b->next);
         }
     }
 
@@ -158,3 +166,135 @@ __attribute__((nonnull(2, 3))) void list_sort(void *priv,
     /* The final merge, rebuilding prev links */
     merge_final(priv, cmp, head, pending, list);
 }
+
+/* Lists shorter than this per thread are not worth the thread startup cost */
+#define PARALLEL_MIN_CHUNK 4096
+
+struct sort_task {
+    void *priv;
+    list_cmp_func_t cmp;
+    struct list_head *a, *b; /* lists to sort or to merge */
+    pthread_t thread;
+    bool spawned;
+};
+
+static void *sort_chunk(void *arg)
+{
+    struct sort_task *t = arg;
+
+    list_sort(t->priv, t->a, t->cmp);
+    return NULL;
+}
+
+/* Merge the non-empty sorted list b after a into a, stably */
+static void *merge_chunks(void *arg)
+{
+    struct sort_task *t = arg;
+    struct list_head *a = t->a->next, *b = t->b->next;
+
+    t->a->prev->next = NULL;
+    t->b->prev->next = NULL;
+    INIT_LIST_HEAD(t->b);
+    merge_final(t->priv, t->cmp, t->a, a, b);
+    return NULL;
+}
+
+/* Run fn on tasks[0..n), tasks[1..n) in new threads.  A task whose thread
+ * cannot be created runs in the calling thread instead.  SIGALRM is blocked
+ * in the new threads, so that a time limit set by the caller still
+ * interrupts the caller.
+ */
+static void run_tasks(struct sort_task *tasks, int n, void *(*fn)(void *))
+{
+    sigset_t alrm, old;
+
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alrm, &old);
+    for (int i = 1; i < n; i++) {
+        tasks[i].spawned =
+            !pthread_create(&tasks[i].thread, NULL, fn, &tasks[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    fn(&tasks[0]);
+    for (int i = 1; i < n; i++) {
+        if (tasks[i].spawned)
+            pthread_join(tasks[i].thread, NULL);
+        else
+            fn(&tasks[i]);
+    }
+}
+
+/**
+ * list_sort_parallel - sort a list with several threads
+ * @priv: private data, opaque to list_sort_parallel(), passed to @cmp
+ * @head: the list to sort
+ * @cmp: the elements comparison function, called concurrently
+ * @nthreads: maximum number of threads, including the caller
+ *
+ * The list is cut into consecutive chunks, one per thread, which are sorted
+ * by list_sort() in parallel.  Neighboring chunks are then merged pairwise
+ * in rounds, the merges of a round running in parallel, until one list is
+ * left.  Since every merge takes from the earlier chunk on ties, the result
+ * is stable, like list_sort().
+ */
+__attribute__((nonnull(2, 3))) void list_sort_parallel(void *priv,
+                                                       struct list_head *head,
+                                                       list_cmp_func_t cmp,
+                                                       int nthreads)
+{
+    struct list_head chunks[LIST_SORT_MAX_THREADS];
+    struct sort_task tasks[LIST_SORT_MAX_THREADS];
+    struct list_head *node;
+    size_t n = 0;
+
+    list_for_each (node, head)
+        n++;
+    if (nthreads > LIST_SORT_MAX_THREADS)
+        nthreads = LIST_SORT_MAX_THREADS;
+    if ((size_t) nthreads > n / PARALLEL_MIN_CHUNK)
+        nthreads = n / PARALLEL_MIN_CHUNK;
+    if (nthreads < 2) {
+        list_sort(priv, head, cmp);
+        return;
+    }
+
+    /* Cut the list into chunks of n / nthreads nodes, the last one taking
+     * the remainder.
+     */
+    for (int i = 0; i < nthreads; i++) {
+        INIT_LIST_HEAD(&chunks[i]);
+        if (i == nthreads - 1) {
+            list_splice_init(head, &chunks[i]);
+        } else {
+            node = head;
+            for (size_t k = 0; k < n / nthreads; k++)
+                node = node->next;
+            list_cut_position(&chunks[i], head, node);
+        }
+        tasks[i] = (struct sort_task){
+            .priv = priv,
+            .cmp = cmp,
+            .a = &chunks[i],
+        };
+    }
+    run_tasks(tasks, nthreads, sort_chunk);
+
+    /* Merge chunks i and i + step into chunk i, for every i multiple of
+     * 2 * step.
+     */
+    for (int step = 1; step < nthreads; step *= 2) {
+        int count = 0;
+        for (int i = 0; i + step < nthreads; i += 2 * step) {
+            tasks[count++] = (struct sort_task){
+                .priv = priv,
+                .cmp = cmp,
+                .a = &chunks[i],
+                .b = &chunks[i + step],
+            };
+        }
+        run_tasks(tasks, count, merge_chunks);
+    }
+
+    list_splice(&chunks[0], head);
+}
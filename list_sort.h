@@ -6,6 +6,16 @@
 
 struct list_head;
 
+/* With LIST_SORT_PREFETCH defined, the merge loops prefetch the node after
+ * the new head of a list as soon as it is taken, so that walking the list
+ * does not stall on a cache miss at every step.
+ */
+#ifdef LIST_SORT_PREFETCH
+#define list_sort_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define list_sort_prefetch(addr) ((void) 0)
+#endif
+
 typedef int
     __attribute__((nonnull(2, 3))) (*list_cmp_func_t)(void *,
                                                       const struct list_head *,
@@ -14,4 +24,12 @@ typedef int
 __attribute__((nonnull(2, 3))) void list_sort(void *priv,
                                               struct list_head *head,
                                               list_cmp_func_t cmp);
+
+/* Upper bound on the threads used by list_sort_parallel() */
+#define LIST_SORT_MAX_THREADS 64
+
+__attribute__((nonnull(2, 3))) void list_sort_parallel(void *priv,
+                                                       struct list_head *head,
+                                                       list_cmp_func_t cmp,
+                                                       int nthreads);
 #endif
@@ -0,0 +1,168 @@
+#ifndef LAB0_LIST_SORT_TEMPLATE_H
+#define LAB0_LIST_SORT_TEMPLATE_H
+
+#include "list.h"
+#include "list_sort.h"
+
+/*
+ * DEFINE_LIST_SORT - generate a list_sort() specialized for one comparison
+ * @name: name of the generated function, static void name(struct list_head *)
+ * @type: type of the structure containing the list nodes
+ * @member: name of the list_head member within @type
+ * @cmp_expr: expression comparing 'const type *a' with 'const type *b',
+ *            negative, zero or positive like the callback of list_sort()
+ *
+ * The algorithm and its stability are those of list_sort() in list_sort.c.
+ * Since the comparison is an expression rather than a call through a function
+ * pointer, the compiler can inline it into the merge loops.
+ *
+ * For example, to sort element_t by value:
+ *   DEFINE_LIST_SORT(sort_by_value, element_t, list,
+ *                    strcmp(a->value, b->value))
+ */
+#define DEFINE_LIST_SORT(name, type, member, cmp_expr) \
+    DEFINE_LIST_SORT_PREFETCH(name, type, member, cmp_expr, p)
+
+/*
+ * DEFINE_LIST_SORT_PREFETCH - DEFINE_LIST_SORT for entries with a payload
+ * @payload_expr: address that cmp_expr reads through 'const type *p'
+ *
+ * When built with LIST_SORT_PREFETCH, each merge step prefetches the node two
+ * places ahead in the list it took from, and the payload of the node after
+ * it, so both are cached by the time they are compared.
+ */
+#define DEFINE_LIST_SORT_PREFETCH(name, type, member, cmp_expr, payload_expr) \
+    static inline int name##_cmp(const struct list_head *la,                  \
+                                 const struct list_head *lb)                  \
+    {                                                                         \
+        const type *a = list_entry(la, type, member);                         \
+        const type *b = list_entry(lb, type, member);                         \
+        return (cmp_expr);                                                    \
+    }                                                                         \
+                                                                              \
+    static inline void name##_prefetch(const struct list_head *node)          \
+    {                                                                         \
+        if (node) {                                                           \
+            const type *p = list_entry(node, type, member);                   \
+            (void) p;                                                         \
+            list_sort_prefetch(node->next);                                   \
+            list_sort_prefetch(payload_expr);                                 \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    /* Merge two null-terminated lists, without maintaining prev links */     \
+    static inline struct list_head *name##_merge(struct list_head *a,         \
+                                                 struct list_head *b)         \
+    {                                                                         \
+        struct list_head *head, **tail = &head;                               \
+                                                                              \
+        for (;;) {                                                            \
+            /* if equal, take 'a' -- important for sort stability */         \
+            if (name##_cmp(a, b) <= 0) {                                      \
+                *tail = a;                                                    \
+                tail = &a->next;                                              \
+                a = a->next;                                                  \
+                if (!a) {                                                     \
+                    *tail = b;                                                \
+                    break;                                                    \
+                }                                                             \
+                name##_prefetch(a->next);                                     \
+            } else {                                                          \
+                *tail = b;                                                    \
+                tail = &b->next;                                              \
+                b = b->next;                                                  \
+                if (!b) {                                                     \
+                    *tail = a;                                                \
+                    break;                                                    \
+                }                                                             \
+                name##_prefetch(b->next);                                     \
+            }                                                                 \
+        }                                                                     \
+        return head;                                                          \
+    }                                                                         \
+                                                                              \
+    /* Final merge, restoring the circular doubly-linked list at head */     \
+    static inline void name##_merge_final(struct list_head *head,             \
+                                          struct list_head *a,                \
+                                          struct list_head *b)                \
+    {                                                                         \
+        struct list_head *tail = head;                                        \
+                                                                              \
+        for (;;) {                                                            \
+            if (name##_cmp(a, b) <= 0) {                                      \
+                tail->next = a;                                               \
+                a->prev = tail;                                               \
+                tail = a;                                                     \
+                a = a->next;                                                  \
+                if (!a)                                                       \
+                    break;                                                    \
+                name##_prefetch(a->next);                                     \
+            } else {                                                          \
+                tail->next = b;                                               \
+                b->prev = tail;                                               \
+                tail = b;                                                     \
+                b = b->next;                                                  \
+                if (!b) {                                                     \
+                    b = a;                                                    \
+                    break;                                                    \
+                }                                                             \
+                name##_prefetch(b->next);                                     \
+            }                                                                 \
+        }                                                                     \
+                                                                              \
+        tail->next = b;                                                       \
+        do {                                                                  \
+            b->prev = tail;                                                   \
+            tail = b;                                                         \
+            b = b->next;                                                      \
+        } while (b);                                                          \
+                                                                              \
+        tail->next = head;                                                    \
+        head->prev = tail;                                                    \
+    }                                                                         \
+                                                                              \
+    static void name(struct list_head *head)                                  \
+    {                                                                         \
+        struct list_head *list = head->next, *pending = NULL;                 \
+        size_t count = 0;                                                     \
+                                                                              \
+        if (list == head->prev)                                               \
+            return;                                                           \
+        head->prev->next = NULL;                                              \
+                                                                              \
+        /* See list_sort() for the invariants on pending */                   \
+        do {                                                                  \
+            size_t bits;                                                      \
+            struct list_head **tail = &pending;                               \
+                                                                              \
+            for (bits = count; bits & 1; bits >>= 1)                          \
+                tail = &(*tail)->prev;                                        \
+            if (bits) {                                                       \
+                struct list_head *a = *tail, *b = a->prev;                    \
+                                                                              \
+                a = name##_merge(b, a);                                       \
+                a->prev = b->prev;                                            \
+                *tail = a;                                                    \
+            }                                                                 \
+                                                                              \
+            list->prev = pending;                                             \
+            pending = list;                                                   \
+            list = list->next;                                                \
+            pending->next = NULL;                                             \
+            count++;                                                          \
+        } while (list);                                                       \
+                                                                              \
+        list = pending;                                                       \
+        pending = pending->prev;                                              \
+        for (;;) {                                                            \
+            struct list_head *next = pending->prev;                           \
+                                                                              \
+            if (!next)                                                        \
+                break;                                                        \
+            list = name##_merge(pending, list);                               \
+            pending = next;                                                   \
+        }                                                                     \
+        name##_merge_final(head, pending, list);                              \
+    }
+
+#endif /* LAB0_LIST_SORT_TEMPLATE_H */
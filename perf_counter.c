@@ -0,0 +1,162 @@
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "dudect/cpucycles.h"
+#include "perf_counter.h"
+
+static const char *event_names[PERF_NR_EVENTS] = {
+    [PERF_CYCLES] = "cycles",
+    [PERF_INSTRUCTIONS] = "instructions",
+    [PERF_L1D_MISSES] = "l1d_misses",
+    [PERF_LLC_MISSES] = "llc_misses",
+    [PERF_BRANCH_MISSES] = "branch_misses",
+};
+
+const char *perf_event_name(perf_event_t ev)
+{
+    return ev < PERF_NR_EVENTS ? event_names[ev] : "unknown";
+}
+
+#if defined(__linux__)
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERF_NR_EVENTS] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+                         PERF_COUNT_HW_CACHE_L1D |
+                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [PERF_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int open_event(perf_event_t ev)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[ev].type;
+    attr.config = events[ev].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    /* Threads created while counting, e.g. by list_sort_parallel(), add
+     * their counts when they exit.
+     */
+    attr.inherit = 1;
+    /* Counters may be multiplexed, so keep the times needed to scale them */
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+bool perf_open(perf_counter_t *pc)
+{
+    bool any = false;
+
+    for (int i = 0; i < PERF_NR_EVENTS; i++) {
+        pc->fd[i] = open_event(i);
+        if (pc->fd[i] >= 0)
+            any = true;
+    }
+    pc->start_cycles = 0;
+    return any;
+}
+
+void perf_close(perf_counter_t *pc)
+{
+    for (int i = 0; i < PERF_NR_EVENTS; i++) {
+        if (pc->fd[i] >= 0)
+            close(pc->fd[i]);
+        pc->fd[i] = -1;
+    }
+}
+
+/* PERF_EVENT_IOC_RESET leaves the counts of exited threads alone, so a
+ * sample is the difference between two reads instead.
+ */
+void perf_start(perf_counter_t *pc)
+{
+    for (int i = 0; i < PERF_NR_EVENTS; i++) {
+        if (pc->fd[i] < 0)
+            continue;
+        ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        if (read(pc->fd[i], pc->start[i], sizeof(pc->start[i])) !=
+            sizeof(pc->start[i]))
+            memset(pc->start[i], 0, sizeof(pc->start[i]));
+    }
+    pc->start_cycles = cpucycles();
+}
+
+void perf_stop(perf_counter_t *pc, perf_sample_t *sample)
+{
+    int64_t cycles = cpucycles() - pc->start_cycles;
+
+    for (int i = 0; i < PERF_NR_EVENTS; i++) {
+        if (pc->fd[i] >= 0)
+            ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    for (int i = 0; i < PERF_NR_EVENTS; i++) {
+        /* value, time enabled, time running */
+        uint64_t buf[3];
+
+        sample->valid[i] = false;
+        sample->count[i] = 0;
+        if (pc->fd[i] < 0 || read(pc->fd[i], buf, sizeof(buf)) != sizeof(buf))
+            continue;
+        for (int k = 0; k < 3; k++)
+            buf[k] -= pc->start[i][k];
+        if (!buf[2])
+            continue;
+        if (buf[2] < buf[1])
+            buf[0] = (uint64_t) ((double) buf[0] * buf[1] / buf[2]);
+        sample->count[i] = buf[0];
+        sample->valid[i] = true;
+    }
+
+    if (!sample->valid[PERF_CYCLES]) {
+        sample->count[PERF_CYCLES] = cycles;
+        sample->valid[PERF_CYCLES] = true;
+    }
+}
+
+#else /* !__linux__ */
+
+bool perf_open(perf_counter_t *pc)
+{
+    for (int i = 0; i < PERF_NR_EVENTS; i++)
+        pc->fd[i] = -1;
+    pc->start_cycles = 0;
+    return false;
+}
+
+void perf_close(perf_counter_t *pc)
+{
+    (void) pc;
+}
+
+void perf_start(perf_counter_t *pc)
+{
+    pc->start_cycles = cpucycles();
+}
+
+void perf_stop(perf_counter_t *pc, perf_sample_t *sample)
+{
+    memset(sample, 0, sizeof(*sample));
+    sample->count[PERF_CYCLES] = cpucycles() - pc->start_cycles;
+    sample->valid[PERF_CYCLES] = true;
+}
+
+#endif /* __linux__ */
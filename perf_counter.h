@@ -0,0 +1,57 @@
+#ifndef LAB0_PERF_COUNTER_H
+#define LAB0_PERF_COUNTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hardware event counters around a region of code, read with Linux
+ * perf_event_open(2).
+ *
+ * Counters that the kernel or the CPU does not provide, e.g. in virtual
+ * machines or when perf_event_paranoid forbids it, are marked invalid in the
+ * sample.  Cycles are always available: without a hardware counter they fall
+ * back to cpucycles(), which counts reference cycles instead of core cycles.
+ * Only user-space events are counted, of the calling thread and of the
+ * threads it creates while counting, so that a multi-threaded region costs
+ * the work of all its threads.
+ */
+
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NR_EVENTS,
+} perf_event_t;
+
+typedef struct {
+    int fd[PERF_NR_EVENTS];
+    /* value, time enabled and time running of each event at perf_start() */
+    uint64_t start[PERF_NR_EVENTS][3];
+    int64_t start_cycles;
+} perf_counter_t;
+
+typedef struct {
+    uint64_t count[PERF_NR_EVENTS];
+    bool valid[PERF_NR_EVENTS];
+} perf_sample_t;
+
+/* Open the counters.  Return false when no hardware counter is available,
+ * in which case only the cpucycles() fallback is measured.
+ */
+bool perf_open(perf_counter_t *pc);
+
+/* Release the counters */
+void perf_close(perf_counter_t *pc);
+
+/* Start counting */
+void perf_start(perf_counter_t *pc);
+
+/* Stop counting and store the counts since perf_start() in sample */
+void perf_stop(perf_counter_t *pc, perf_sample_t *sample);
+
+/* Short name of an event, suitable for column headers */
+const char *perf_event_name(perf_event_t ev);
+
+#endif /* LAB0_PERF_COUNTER_H */
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <random.h>
 #include <signal.h>
 #include <spawn.h>
@@ -22,14 +23,24 @@
 
 #include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
+#include "dudect/ttest.h"
+#include "extsort.h"
+#include "histogram.h"
 #include "list.h"
 #include "list_sort.h"
+#include "perf_counter.h"
 #include "random.h"
+#include "timsort.h"
 
 /* Shannon entropy */
 extern double shannon_entropy(const uint8_t *input_data);
 extern int show_entropy;
 
+/* Algorithm picked by the last call of q_sort(), if queue.c defines it.
+ * queue.h cannot declare it, and queue.c files without it must link too.
+ */
+extern const char *q_sort_choice __attribute__((weak));
+
 /* Our program needs to use regular malloc/free */
 #define INTERNAL 1
 #include "harness.h"
@@ -86,6 +97,69 @@ typedef enum {
     POS_TAIL,
     POS_HEAD,
 } position_t;
+/* Latency of every q_* call made by the command handlers, in cycles */
+typedef enum {
+    Q_NEW,
+    Q_FREE,
+    Q_INSERT_HEAD,
+    Q_INSERT_TAIL,
+    Q_REMOVE_HEAD,
+    Q_REMOVE_TAIL,
+    Q_SIZE,
+    Q_DELETE_MID,
+    Q_DELETE_DUP,
+    Q_SWAP,
+    Q_REVERSE,
+    Q_REVERSEK,
+    Q_SORT,
+    Q_ASCEND,
+    Q_DESCEND,
+    Q_MERGE,
+    Q_NR_OPS,
+} q_op_t;
+
+static const char *const q_op_names[Q_NR_OPS] = {
+    "q_new", "q_free", "q_insert_head", "q_insert_tail", "q_remove_head",
+    "q_remove_tail", "q_size", "q_delete_mid", "q_delete_dup", "q_swap",
+    "q_reverse", "q_reverseK", "q_sort", "q_ascend", "q_descend", "q_merge",
+};
+
+static histogram_t q_latency[Q_NR_OPS];
+
+/* Reference point for converting cycles to nanoseconds, taken at startup */
+static int64_t lat_base_cycles, lat_base_ns;
+
+static inline void q_latency_record(q_op_t op, int64_t start)
+{
+    int64_t cycles = cpucycles() - start;
+    hist_record(&q_latency[op], cycles > 0 ? cycles : 0);
+}
+
+static int64_t lat_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Cycles per nanosecond since startup, which grows more precise with time */
+static double latency_cycles_per_ns()
+{
+    int64_t ns = lat_now_ns() - lat_base_ns;
+    int64_t cycles = cpucycles() - lat_base_cycles;
+    return ns > 0 && cycles > 0 ? (double) cycles / ns : 1.0;
+}
+
+/* Run the statement making a q_* call, recording its latency under op.  If
+ * the call is interrupted by an exception, nothing is recorded.
+ */
+#define Q_TIMED(op, ...)                   \
+    do {                                   \
+        int64_t __lat_start = cpucycles(); \
+        __VA_ARGS__;                       \
+        q_latency_record(op, __lat_start); \
+    } while (0)
+
 /* Forward declarations */
 static bool q_show(int vlevel);
 
@@ -117,7 +191,7 @@ static bool do_free(int argc, char *argv[])
         list_del(&current->chain);
 
         if (exception_setup(true))
-            q_free(current->q);
+            Q_TIMED(Q_FREE, q_free(current->q));
         exception_cancel();
         set_cautious_mode(true);
     }
@@ -155,7 +229,7 @@ static bool do_new(int argc, char *argv[])
         list_add_tail(&qctx->chain, &chain.head);
 
         qctx->size = 0;
-        qctx->q = q_new();
+        Q_TIMED(Q_NEW, qctx->q = q_new());
         qctx->id = chain.size++;
 
         current = qctx;
@@ -169,16 +243,30 @@ static bool do_new(int argc, char *argv[])
 /* TODO: Add a buf_size check of if the buf_size may be less
  * than MIN_RANDSTR_LEN.
  */
-static void fill_rand_string(char *buf, size_t buf_size)
+static size_t rand_string_len(size_t buf_size)
 {
     size_t len = 0;
     while (len < MIN_RANDSTR_LEN)
         len = rand() % buf_size;
+    return len;
+}
 
+/* Fill buf with len random letters, taking the random bytes from rng */
+static void fill_rand_string(char *buf,
+                             size_t len,
+                             int (*rng)(uint8_t *, size_t))
+{
     uint64_t randstr_buf_64[MAX_RANDSTR_LEN] = {0};
-    randombytes((uint8_t *) randstr_buf_64, len * sizeof(uint64_t));
-    for (size_t n = 0; n < len; n++)
-        buf[n] = charset[randstr_buf_64[n] % (sizeof(charset) - 1)];
+    for (size_t n = 0; n < len; n++) {
+        size_t k = n % MAX_RANDSTR_LEN;
+        if (!k) {
+            size_t left = len - n;
+            if (left > MAX_RANDSTR_LEN)
+                left = MAX_RANDSTR_LEN;
+            rng((uint8_t *) randstr_buf_64, left * sizeof(uint64_t));
+        }
+        buf[n] = charset[randstr_buf_64[k] % (sizeof(charset) - 1)];
+    }
 
     buf[len] = '\0';
 }
@@ -232,9 +320,16 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
-                                        : q_insert_head(current->q, inserts);
+                fill_rand_string(randstr_buf,
+                                 rand_string_len(sizeof(randstr_buf)),
+                                 randombytes);
+            bool rval;
+            if (pos == POS_TAIL)
+                Q_TIMED(Q_INSERT_TAIL,
+                        rval = q_insert_tail(current->q, inserts));
+            else
+                Q_TIMED(Q_INSERT_HEAD,
+                        rval = q_insert_head(current->q, inserts));
             if (rval) {
                 current->size++;
                 element_t *entry =
@@ -353,10 +448,14 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
-    if (current && exception_setup(true))
-        re = pos == POS_TAIL
-                 ? q_remove_tail(current->q, removes, string_length + 1)
-                 : q_remove_head(current->q, removes, string_length + 1);
+    if (current && exception_setup(true)) {
+        if (pos == POS_TAIL)
+            Q_TIMED(Q_REMOVE_TAIL, re = q_remove_tail(current->q, removes,
+                                                      string_length + 1));
+        else
+            Q_TIMED(Q_REMOVE_HEAD, re = q_remove_head(current->q, removes,
+                                                      string_length + 1));
+    }
     exception_cancel();
 
     bool is_null = re ? false : true;
@@ -468,7 +567,7 @@ static bool do_dedup(int argc, char *argv[])
 
     bool ok = true;
     if (exception_setup(true))
-        ok = q_delete_dup(current->q);
+        Q_TIMED(Q_DELETE_DUP, ok = q_delete_dup(current->q));
     exception_cancel();
 
     if (!ok) {
@@ -529,7 +628,7 @@ static bool do_reverse(int argc, char *argv[])
 
     set_noallocate_mode(true);
     if (current && exception_setup(true))
-        q_reverse(current->q);
+        Q_TIMED(Q_REVERSE, q_reverse(current->q));
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -558,7 +657,7 @@ static bool do_size(int argc, char *argv[])
 
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
-            cnt = q_size(current->q);
+            Q_TIMED(Q_SIZE, cnt = q_size(current->q));
             ok = ok && !error_check();
         }
     }
@@ -617,9 +716,11 @@ bool do_sort(int argc, char *argv[])
                current->size, MAX_NODES);
 
     if (current && exception_setup(true))
-        q_sort(current->q, descend);
+        Q_TIMED(Q_SORT, q_sort(current->q, descend));
     exception_cancel();
     set_noallocate_mode(false);
+    if (current && &q_sort_choice)
+        report(3, "q_sort picked %s", q_sort_choice);
 
     bool ok = true;
     if (current && current->size) {
@@ -671,6 +772,390 @@ bool do_sort(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Check that the queue is ordered after a sort, which costs less than it */
+static bool check_sorted(struct list_head *head)
+{
+    element_t *e, *next;
+
+    list_for_each_entry (e, head, list) {
+        if (e->list.next == head)
+            break;
+        next = list_entry(e->list.next, element_t, list);
+        int c = strcmp(e->value, next->value);
+        if (descend ? c < 0 : c > 0)
+            return false;
+    }
+    return true;
+}
+
+/* Default memory budget of extsort, in bytes */
+#define EXTSORT_BUDGET (1 << 20)
+
+static bool do_extsort(int argc, char *argv[])
+{
+    int budget = EXTSORT_BUDGET;
+    FILE *out = NULL;
+
+    if (argc > 3) {
+        report(1, "%s takes at most two arguments", argv[0]);
+        return false;
+    }
+    if (argc > 1 && (!get_int(argv[1], &budget) || budget < 1)) {
+        report(1, "Invalid budget '%s'", argv[1]);
+        return false;
+    }
+    if (!current || !current->q) {
+        report(3, "Warning: Calling extsort on null queue");
+        return false;
+    }
+    if (argc > 2) {
+        out = fopen(argv[2], "w");
+        if (!out) {
+            report(1, "Cannot open '%s' for writing", argv[2]);
+            return false;
+        }
+    }
+    error_check();
+
+    extsort_stats_t stats = {0};
+    size_t size = q_size(current->q);
+    bool ok = false;
+    if (exception_setup(false))
+        ok = q_ext_sort(current->q, descend, budget, out, &stats);
+    exception_cancel();
+    if (out && fclose(out))
+        ok = false;
+    current->size = q_size(current->q);
+
+    if (!ok) {
+        report(1, "ERROR: External sort failed");
+    } else if (stats.elements != size) {
+        report(1, "ERROR: Sorted %zu elements out of %zu", stats.elements,
+               size);
+        ok = false;
+    } else if (!out && !check_sorted(current->q)) {
+        report(1, "ERROR: Not sorted in %s order",
+               descend ? "descending" : "ascending");
+        ok = false;
+    }
+    report(3, "Sorted %zu elements in %zu runs, %zu bytes spilled",
+           stats.elements, stats.runs, stats.bytes_spilled);
+    q_show(3);
+    return ok && !error_check();
+}
+
+/* Operations mixed by the workload command */
+typedef enum {
+    WL_IH,
+    WL_IT,
+    WL_RH,
+    WL_RT,
+    WL_SORT,
+    WL_DEDUP,
+    WL_REVERSE,
+    WL_NR_OPS,
+} wl_op_t;
+
+static const char *const wl_names[WL_NR_OPS] = {
+    "ih", "it", "rh", "rt", "sort", "dedup", "reverse",
+};
+
+#define WL_DEFAULT_MIX "ih=30,it=30,rh=20,rt=20"
+#define WL_DEFAULT_LEN "5-9"
+#define WL_MAX_LEN 1024
+
+/* Cycles taken by each operation of the last workload.  They are kept out
+ * of the latencies of stats, which the random strings would skew, and are
+ * reported in nanoseconds like those.
+ */
+static histogram_t wl_hist[WL_NR_OPS];
+
+/* splitmix64, so that a seed reproduces the same workload */
+static uint64_t wl_state;
+
+static inline uint64_t wl_rand(void)
+{
+    wl_state += 0x9e3779b97f4a7c15ULL;
+    return random_shuffle(wl_state);
+}
+
+/* The seeded counterpart of randombytes() for fill_rand_string() */
+static int wl_randombytes(uint8_t *buf, size_t len)
+{
+    for (size_t n = 0; n < len; n += sizeof(uint64_t)) {
+        uint64_t r = wl_rand();
+        memcpy(buf + n, &r, len - n < sizeof(r) ? len - n : sizeof(r));
+    }
+    return 0;
+}
+
+/* String lengths, uniform over [min, max] or geometric with the given mean */
+typedef struct {
+    int min, max;
+    int mean;
+} wl_len_t;
+
+static bool parse_wl_len(const char *spec, wl_len_t *len)
+{
+    char *end;
+
+    len->mean = 0;
+    if (spec[0] == '~') {
+        len->mean = strtol(spec + 1, &end, 10);
+        len->min = 1;
+        len->max = WL_MAX_LEN;
+        return *end == '\0' && len->mean >= 1 && len->mean <= WL_MAX_LEN;
+    }
+    len->min = len->max = strtol(spec, &end, 10);
+    if (*end == '-')
+        len->max = strtol(end + 1, &end, 10);
+    return *end == '\0' && len->min >= 1 && len->min <= len->max &&
+           len->max <= WL_MAX_LEN;
+}
+
+static int wl_pick_len(const wl_len_t *len)
+{
+    if (!len->mean)
+        return len->min + wl_rand() % (len->max - len->min + 1);
+
+    /* Geometric: each further character with probability 1 - 1 / mean */
+    int n = 1;
+    uint64_t cont = UINT64_MAX - UINT64_MAX / len->mean;
+    while (n < len->max && wl_rand() < cont)
+        n++;
+    return n;
+}
+
+/* Parse "op=weight,..." into weights.  Return the total weight, or -1. */
+static int parse_wl_mix(const char *spec, int *weight)
+{
+    char buf[MAX_CHAR];
+    char *save = NULL;
+    int total = 0;
+
+    memset(weight, 0, WL_NR_OPS * sizeof(int));
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (char *tok = strtok_r(buf, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        int op, w;
+        if (eq)
+            *eq = '\0';
+        for (op = 0; op < WL_NR_OPS && strcmp(tok, wl_names[op]); op++)
+            ;
+        if (op == WL_NR_OPS || !eq || !get_int(eq + 1, &w) || w < 0) {
+            report(1, "Invalid operation weight '%s'", tok);
+            return -1;
+        }
+        weight[op] = w;
+        total += w;
+    }
+    if (!total)
+        report(1, "Operation weights add up to 0");
+    return total ? total : -1;
+}
+
+static void wl_report(int64_t ns, int ops, int skipped)
+{
+    double rate = latency_cycles_per_ns();
+
+    report(1, "%d operations in %.3f s, %.0f ops/s, queue size %d", ops,
+           ns / 1e9, ns ? ops * 1e9 / ns : 0.0, current->size);
+    if (skipped)
+        report(1, "%d removals drawn on an empty queue were skipped", skipped);
+    report(1, "  %-8s%10s%10s%10s%10s%10s%12s", "Op", "Count", "min", "p50",
+           "p90", "p99", "max ns");
+    for (int op = 0; op < WL_NR_OPS; op++) {
+        const histogram_t *h = &wl_hist[op];
+        if (!h->count)
+            continue;
+        report(1, "  %-8s%10llu%10.0f%10.0f%10.0f%10.0f%12.0f", wl_names[op],
+               (unsigned long long) h->count, h->min / rate,
+               hist_percentile(h, 50.0) / rate,
+               hist_percentile(h, 90.0) / rate,
+               hist_percentile(h, 99.0) / rate, h->max / rate);
+    }
+}
+
+static bool do_workload(int argc, char *argv[])
+{
+    int weight[WL_NR_OPS], total, ops, seed = 1;
+    wl_len_t len;
+
+    if (argc < 2 || argc > 5) {
+        report(1, "%s takes 1-4 arguments", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &ops) || ops < 0) {
+        report(1, "Invalid number of operations '%s'", argv[1]);
+        return false;
+    }
+    if ((total = parse_wl_mix(argc > 2 ? argv[2] : WL_DEFAULT_MIX, weight)) <
+        0)
+        return false;
+    if (!parse_wl_len(argc > 3 ? argv[3] : WL_DEFAULT_LEN, &len)) {
+        report(1, "Invalid length '%s', use N, MIN-MAX or ~MEAN up to %d",
+               argv[3], WL_MAX_LEN);
+        return false;
+    }
+    if (argc > 4 && !get_int(argv[4], &seed)) {
+        report(1, "Invalid seed '%s'", argv[4]);
+        return false;
+    }
+    if (!current || !current->q) {
+        report(3, "Warning: Calling workload on null queue");
+        return false;
+    }
+    error_check();
+
+    char value[WL_MAX_LEN + 1], removed[WL_MAX_LEN + 1];
+    /* Kept across a longjmp out of a queue operation */
+    volatile int done = 0, skipped = 0;
+    volatile bool ok = true;
+    struct list_head *q = current->q;
+
+    wl_state = seed;
+    for (int op = 0; op < WL_NR_OPS; op++)
+        hist_reset(&wl_hist[op]);
+
+    int64_t start_ns = lat_now_ns();
+    if (exception_setup(false)) {
+        while (ok && done < ops) {
+            int r = wl_rand() % total, op = 0;
+            while (r >= weight[op])
+                r -= weight[op++];
+
+            /* A removal from an empty queue does not count as an operation */
+            if ((op == WL_RH || op == WL_RT) && list_empty(q)) {
+                skipped++;
+                if (weight[WL_RH] + weight[WL_RT] == total) {
+                    report(1, "Queue emptied by a mix of removals only");
+                    break;
+                }
+                continue;
+            }
+
+            int64_t t0 = 0, t1 = 0;
+            switch (op) {
+            case WL_IH:
+            case WL_IT: {
+                fill_rand_string(value, wl_pick_len(&len), wl_randombytes);
+                t0 = cpucycles();
+                bool inserted = op == WL_IH ? q_insert_head(q, value)
+                                            : q_insert_tail(q, value);
+                t1 = cpucycles();
+                /* Failures are expected while malloc failures are injected */
+                if (inserted)
+                    current->size++;
+                break;
+            }
+            case WL_RH:
+            case WL_RT: {
+                t0 = cpucycles();
+                element_t *e =
+                    op == WL_RH ? q_remove_head(q, removed, sizeof(removed))
+                                : q_remove_tail(q, removed, sizeof(removed));
+                t1 = cpucycles();
+                if (!e) {
+                    report(1, "ERROR: Removal from non-empty queue failed");
+                    ok = false;
+                    break;
+                }
+                if (strcmp(removed, e->value)) {
+                    report(1, "ERROR: Removed value %s != stored value %s",
+                           removed, e->value);
+                    ok = false;
+                }
+                q_release_element(e);
+                current->size--;
+                break;
+            }
+            case WL_SORT:
+                set_noallocate_mode(true);
+                t0 = cpucycles();
+                q_sort(q, descend);
+                t1 = cpucycles();
+                set_noallocate_mode(false);
+                if (!check_sorted(q)) {
+                    report(1, "ERROR: Not sorted in %s order",
+                           descend ? "descending" : "ascending");
+                    ok = false;
+                }
+                break;
+            case WL_DEDUP:
+                t0 = cpucycles();
+                q_delete_dup(q);
+                t1 = cpucycles();
+                current->size = q_size(q);
+                break;
+            case WL_REVERSE:
+                set_noallocate_mode(true);
+                t0 = cpucycles();
+                q_reverse(q);
+                t1 = cpucycles();
+                set_noallocate_mode(false);
+                break;
+            }
+            hist_record(&wl_hist[op], t1 > t0 ? t1 - t0 : 0);
+            done++;
+        }
+    } else {
+        ok = false;
+        current->size = q_size(q);
+    }
+    exception_cancel();
+    set_noallocate_mode(false);
+    int64_t ns = lat_now_ns() - start_ns;
+
+    wl_report(ns, done, skipped);
+    q_show(3);
+    return ok && !error_check();
+}
+
+static void latency_reset()
+{
+    for (int op = 0; op < Q_NR_OPS; op++)
+        hist_reset(&q_latency[op]);
+}
+
+static void latency_init()
+{
+    latency_reset();
+    lat_base_ns = lat_now_ns();
+    lat_base_cycles = cpucycles();
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes at most one argument", argv[0]);
+        return false;
+    }
+    if (argc == 2) {
+        if (strcmp(argv[1], "reset")) {
+            report(1, "Unknown stats action '%s'", argv[1]);
+            return false;
+        }
+        latency_reset();
+        return true;
+    }
+
+    double rate = latency_cycles_per_ns();
+    report(1, "  %-14s%10s%10s%10s%10s%10s%12s", "Operation", "Calls", "p50",
+           "p90", "p99", "p99.9", "max ns");
+    for (int op = 0; op < Q_NR_OPS; op++) {
+        const histogram_t *h = &q_latency[op];
+        if (!h->count)
+            continue;
+        report(1, "  %-14s%10llu%10.0f%10.0f%10.0f%10.0f%12.0f", q_op_names[op],
+               (unsigned long long) h->count, hist_percentile(h, 50.0) / rate,
+               hist_percentile(h, 90.0) / rate, hist_percentile(h, 99.0) / rate,
+               hist_percentile(h, 99.9) / rate, h->max / rate);
+    }
+    return true;
+}
+
 static bool do_dm(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -686,7 +1171,7 @@ static bool do_dm(int argc, char *argv[])
 
     bool ok = true;
     if (exception_setup(true))
-        ok = q_delete_mid(current->q);
+        Q_TIMED(Q_DELETE_MID, ok = q_delete_mid(current->q));
     exception_cancel();
 
     if (!current->size)
@@ -712,7 +1197,7 @@ static bool do_swap(int argc, char *argv[])
 
     set_noallocate_mode(true);
     if (exception_setup(true))
-        q_swap(current->q);
+        Q_TIMED(Q_SWAP, q_swap(current->q));
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -744,7 +1229,7 @@ static bool do_ascend(int argc, char *argv[])
     error_check();
 
     if (exception_setup(true))
-        current->size = q_ascend(current->q);
+        Q_TIMED(Q_ASCEND, current->size = q_ascend(current->q));
     set_noallocate_mode(false);
 
     bool ok = true;
@@ -791,7 +1276,7 @@ static bool do_descend(int argc, char *argv[])
     error_check();
 
     if (exception_setup(true))
-        current->size = q_descend(current->q);
+        Q_TIMED(Q_DESCEND, current->size = q_descend(current->q));
     set_noallocate_mode(false);
 
     bool ok = true;
@@ -838,7 +1323,7 @@ static bool do_reverseK(int argc, char *argv[])
 
     set_noallocate_mode(true);
     if (exception_setup(true))
-        q_reverseK(current->q, k);
+        Q_TIMED(Q_REVERSEK, q_reverseK(current->q, k));
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -862,7 +1347,7 @@ static bool do_merge(int argc, char *argv[])
     int len = 0;
     set_noallocate_mode(true);
     if (current && exception_setup(true))
-        len = q_merge(&chain.head, descend);
+        Q_TIMED(Q_MERGE, len = q_merge(&chain.head, descend));
     exception_cancel();
     set_noallocate_mode(false);
 
@@ -875,7 +1360,7 @@ static bool do_merge(int argc, char *argv[])
         while ((uintptr_t) cur != (uintptr_t) &chain.head) {
             queue_contex_t *ctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
-            q_free(ctx->q);
+            Q_TIMED(Q_FREE, q_free(ctx->q));
             free(ctx);
         }
 
@@ -1070,26 +1555,309 @@ static int cmp_func(void *priv,
                   list_entry(b, element_t, list)->value);
 }
 
+typedef void (*sort_func_t)(struct list_head *head);
+
+static void run_q_sort(struct list_head *head)
+{
+    q_sort(head, false);
+}
+
+static void run_list_sort(struct list_head *head)
+{
+    list_sort(NULL, head, cmp_func);
+}
+
+static void run_timsort(struct list_head *head)
+{
+    timsort(NULL, head, cmp_func);
+}
+
+static void run_list_sort_parallel(struct list_head *head)
+{
+    list_sort_parallel(NULL, head, cmp_func, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/* Sorts known to cmp_sorting */
+static const struct {
+    const char *name;
+    sort_func_t sort;
+    bool threaded; /* runs helper threads */
+} sorts[] = {
+    {"q_sort", run_q_sort, false},
+    {"list_sort", run_list_sort, false},
+    {"timsort", run_timsort, false},
+    {"list_sort_parallel", run_list_sort_parallel, true},
+};
+
+#define NR_SORTS (sizeof(sorts) / sizeof(sorts[0]))
+
+/* Shapes of the input queue known to cmp_sorting */
+static const char *const dists[] = {"random", "sorted", "reverse", "partial"};
+
+#define NR_DISTS (sizeof(dists) / sizeof(dists[0]))
+
+/* Arrange the random strings of queue q into distribution d */
+static void shape_queue(struct list_head *q, int d)
+{
+    if (!strcmp(dists[d], "sorted") || !strcmp(dists[d], "partial"))
+        q_sort(q, false);
+    else if (!strcmp(dists[d], "reverse"))
+        q_sort(q, true);
+
+    if (strcmp(dists[d], "partial"))
+        return;
+
+    /* Swap about 1% of the values with one a little further away */
+    element_t *e;
+    list_for_each_entry (e, q, list) {
+        if (rand() % 100)
+            continue;
+        element_t *other = e;
+        for (int k = rand() % 64; k > 0 && other->list.next != q; k--)
+            other = list_entry(other->list.next, element_t, list);
+        char *tmp = e->value;
+        e->value = other->value;
+        other->value = tmp;
+    }
+}
+
+static int find_sort(const char *name)
+{
+    for (size_t i = 0; i < NR_SORTS; i++) {
+        if (!strcmp(name, sorts[i].name))
+            return i;
+    }
+    return -1;
+}
+
+static int find_dist(const char *name)
+{
+    for (size_t i = 0; i < NR_DISTS; i++) {
+        if (!strcmp(name, dists[i]))
+            return i;
+    }
+    return -1;
+}
+
+/* Look up each comma-separated name of list with find, storing at most max
+ * indices in idx.  Return their number, or -1 when a name is unknown.
+ */
+static int parse_names(const char *list,
+                       int (*find)(const char *),
+                       int *idx,
+                       int max)
+{
+    char buf[MAX_CHAR];
+    char *save = NULL;
+    int count = 0;
+
+    strncpy(buf, list, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (char *tok = strtok_r(buf, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        int i = find(tok);
+        if (i < 0) {
+            report(1, "Unknown name '%s'", tok);
+            return -1;
+        }
+        if (count < max)
+            idx[count++] = i;
+    }
+    return count;
+}
+
+#define CMP_MAX_REPS 1000
+
+/* Samples of one sort over the repetitions */
+typedef struct {
+    int64_t count[PERF_NR_EVENTS][CMP_MAX_REPS];
+    bool valid[PERF_NR_EVENTS];
+    int64_t ns[CMP_MAX_REPS];
+    alloc_stats_t before, after;
+} sort_samples_t;
+
+static sort_samples_t samples[NR_SORTS];
+
+/* Sort a copy of the current queue, recording repetition rep of s unless
+ * rep is negative.
+ */
+static void sort_once(int s, int rep, perf_counter_t *pc)
+{
+    struct list_head *copy_head = q_duplicate(current->q);
+    sort_samples_t *out = &samples[s];
+    perf_sample_t sample;
+    struct timespec ts;
+    int64_t before_ns;
+
+    alloc_stats(&out->before);
+    size_t outer_peak = alloc_stats_mark();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    before_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    perf_start(pc);
+    sorts[s].sort(copy_head);
+    perf_stop(pc, &sample);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    alloc_stats(&out->after);
+    alloc_stats_unmark(outer_peak);
+
+    if (rep >= 0) {
+        out->ns[rep] = ts.tv_sec * 1000000000LL + ts.tv_nsec - before_ns;
+        for (int e = 0; e < PERF_NR_EVENTS; e++) {
+            out->count[e][rep] = sample.count[e];
+            out->valid[e] = sample.valid[e];
+        }
+    }
+
+    /* Checking each free against every allocated block is quadratic */
+    set_cautious_mode(false);
+    q_free(copy_head);
+    set_cautious_mode(true);
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t va = *(const int64_t *) a, vb = *(const int64_t *) b;
+    return (va > vb) - (va < vb);
+}
+
+/* Median of x[0..n), which gets sorted */
+static int64_t median(int64_t *x, int n)
+{
+    qsort(x, n, sizeof(*x), cmp_int64);
+    return n % 2 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+}
+
+/* Median absolute deviation of x[0..n) around its median m */
+static int64_t mad(const int64_t *x, int n, int64_t m)
+{
+    int64_t dev[CMP_MAX_REPS];
+    for (int i = 0; i < n; i++)
+        dev[i] = x[i] > m ? x[i] - m : m - x[i];
+    return median(dev, n);
+}
+
+/* |t| above which the difference of means is reported as significant.
+ * With a few dozen samples this is roughly a two-sided p < 0.01.
+ */
+#define T_SIGNIFICANT 3.0
+
+/* Print median and MAD of every sort, and Welch's t-test of each against
+ * the first one.  Hardware counters add up the work of all the threads of a
+ * sort, while cycles counted by cpucycles() are elapsed, so hw_cycles tells
+ * which of them a threaded sort is compared by.
+ */
+static void report_sorts(const int *idx,
+                         int nsorts,
+                         int reps,
+                         int d,
+                         int n,
+                         bool hw_cycles)
+{
+    t_context_t t;
+    int64_t cycles[CMP_MAX_REPS];
+
+    printf("%s input, %d elements, %d runs\n", dists[d], n, reps);
+    printf("%-20s %14s %12s %10s\n", "sort", "median cycles", "MAD",
+           nsorts > 1 ? "t" : "");
+
+    for (int i = 0; i < nsorts; i++) {
+        sort_samples_t *smp = &samples[idx[i]];
+        const char *name = sorts[idx[i]].name;
+
+        t_init(&t);
+        for (int r = 0; r < reps; r++) {
+            t_push(&t, samples[idx[0]].count[PERF_CYCLES][r], 0);
+            t_push(&t, smp->count[PERF_CYCLES][r], 1);
+        }
+
+        memcpy(cycles, smp->count[PERF_CYCLES], reps * sizeof(int64_t));
+        int64_t med = median(cycles, reps);
+        printf("%-20s %14" PRId64 " %12" PRId64, name, med,
+               mad(cycles, reps, med));
+        if (i > 0) {
+            double tval = t_compute(&t);
+            printf(" %10.2f", tval);
+            if (tval > T_SIGNIFICANT)
+                printf("  faster than %s", sorts[idx[0]].name);
+            else if (tval < -T_SIGNIFICANT)
+                printf("  slower than %s", sorts[idx[0]].name);
+        }
+        printf("\n");
+
+        for (int e = PERF_CYCLES + 1; e < PERF_NR_EVENTS; e++) {
+            if (!smp->valid[e])
+                continue;
+            memcpy(cycles, smp->count[e], reps * sizeof(int64_t));
+            printf("%20s %s/elem %.2f\n", "", perf_event_name(e),
+                   (double) median(cycles, reps) / n);
+        }
+        if (sorts[idx[i]].threaded) {
+            printf("%20s %s\n", "",
+                   hw_cycles ? "counts summed over all its threads"
+                             : "cycles elapsed, other counts summed over all "
+                               "its threads");
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "n=%d dist=%s", n, dists[d]);
+        bench_record_t rec = {
+            .name = name,
+            .params = params,
+            .cycles = med,
+            .ns = median(smp->ns, reps),
+            .allocs = smp->after.alloc_cnt - smp->before.alloc_cnt,
+            .frees = smp->after.free_cnt - smp->before.free_cnt,
+            .peak_bytes = smp->after.last_peak_bytes,
+        };
+        report_bench(&rec);
+    }
+}
+
+/* Overwrite the previous line of progress output on a terminal */
+static void clear_last_line()
+{
+    if (isatty(STDOUT_FILENO))
+        printf("\033[2K\033[A");
+}
+
 #define DEFAULT_QUEUE_SIZE "10000"
+#define DEFAULT_REPS 10
 static bool do_cmp_sorting(int argc, char *argv[])
 {
-    struct list_head *copy_head, *warmup_head;
-    char **inner_argv;
-    int64_t before, after, exc_time;
-    int queue_size;
+    char *inner_argv[3];
+    int sort_idx[NR_SORTS] = {0, 1}, dist_idx[NR_DISTS] = {0};
+    int queue_size, reps = DEFAULT_REPS, nsorts = 2, ndists = 1;
 
-    inner_argv = malloc(3 * sizeof(char *));
+    if (argc > 5) {
+        report(1, "%s takes at most 4 arguments", argv[0]);
+        return false;
+    }
 
     inner_argv[0] = "cmp_sorting";
     inner_argv[1] = "RAND";
+    inner_argv[2] = DEFAULT_QUEUE_SIZE;
     if (argc > 1) {
-        if (!get_int(argv[1], &queue_size)) {
+        if (!get_int(argv[1], &queue_size) || queue_size < 1) {
             report(1, "Invalid number of queue size '%s'", argv[1]);
             return false;
         }
         inner_argv[2] = argv[1];
-    } else {
-        inner_argv[2] = DEFAULT_QUEUE_SIZE;
+    }
+    get_int(inner_argv[2], &queue_size);
+    if (argc > 2 &&
+        (!get_int(argv[2], &reps) || reps < 2 || reps > CMP_MAX_REPS)) {
+        report(1, "Number of runs must be between 2 and %d", CMP_MAX_REPS);
+        return false;
+    }
+    if (argc > 3) {
+        nsorts = parse_names(argv[3], find_sort, sort_idx, NR_SORTS);
+        if (nsorts <= 0)
+            return false;
+    }
+    if (argc > 4) {
+        ndists = parse_names(argv[4], find_dist, dist_idx, NR_DISTS);
+        if (ndists <= 0)
+            return false;
     }
 
     if (current) {
@@ -1097,41 +1865,34 @@ static bool do_cmp_sorting(int argc, char *argv[])
         return false;
     }
 
-    do_new(1, NULL);
-    do_ih(3, inner_argv);
-    printf("\033[2K\033[A");
-    printf("Start comparing...\n");
-
-    copy_head = q_duplicate(current->q);
-    warmup_head = q_duplicate(current->q);
-    q_sort(warmup_head, false);
-
-    before = cpucycles();
-    q_sort(copy_head, false);
-    after = cpucycles();
-    exc_time = after - before;
-    printf("my_sort  : %ld\n", exc_time);
-
-    q_free(copy_head);
-    q_free(warmup_head);
+    perf_counter_t pc;
+    if (!perf_open(&pc))
+        report(3, "No hardware counters, counting cycles with cpucycles()");
 
+    for (int d = 0; d < ndists; d++) {
+        do_new(1, NULL);
+        do_ih(3, inner_argv);
+        shape_queue(current->q, dist_idx[d]);
+        clear_last_line();
+        printf("Start comparing...\n");
 
-    copy_head = q_duplicate(current->q);
-    warmup_head = q_duplicate(current->q);
-    list_sort(NULL, warmup_head, cmp_func);
-
-    before = cpucycles();
-    list_sort(NULL, copy_head, cmp_func);
-    after = cpucycles();
-    exc_time = after - before;
-    printf("list_sort: %ld\n", exc_time);
+        /* One warmup run each, then interleave the sorts so that drifts in
+         * machine load affect all of them alike.
+         */
+        for (int i = 0; i < nsorts; i++)
+            sort_once(sort_idx[i], -1, &pc);
+        for (int r = 0; r < reps; r++) {
+            for (int i = 0; i < nsorts; i++)
+                sort_once(sort_idx[i], r, &pc);
+        }
 
-    q_free(warmup_head);
-    q_free(copy_head);
+        do_free(1, NULL);
+        clear_last_line();
+        report_sorts(sort_idx, nsorts, reps, dist_idx[d], queue_size,
+                     pc.fd[PERF_CYCLES] >= 0);
+    }
 
-    do_free(1, NULL);
-    free(inner_argv);
-    printf("\033[2K\033[A");
+    perf_close(&pc);
     printf("Finished.\n");
     return true;
 }
@@ -1245,6 +2006,21 @@ static void console_init()
         "[str]");
     ADD_COMMAND(reverse, "Reverse queue", "");
     ADD_COMMAND(sort, "Sort queue in ascending/descening order", "");
+    ADD_COMMAND(stats,
+                "Show p50/p90/p99/p99.9/max latency of every queue "
+                "operation called by commands other than workload so far, "
+                "or start over",
+                "[reset]");
+    ADD_COMMAND(workload,
+                "Run n random operations against the queue, mixed by "
+                "weight (default " WL_DEFAULT_MIX "), inserting strings of "
+                "length N, MIN-MAX or ~MEAN (default " WL_DEFAULT_LEN
+                "), and report the latency of each operation",
+                "n [mix] [len] [seed]");
+    ADD_COMMAND(extsort,
+                "Sort queue with an external merge sort spilling runs of at "
+                "most budget bytes (default 1MB), into file if given",
+                "[budget] [file]");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
     ADD_COMMAND(shuffle, "Shuffle nodes in queue", "");
@@ -1263,9 +2039,11 @@ static void console_init()
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
     ADD_COMMAND(cmp_sorting,
-                "compare efficiency of different sorting methods with queue "
-                "of size n.(default: n == 5000000)",
-                "[n]");
+                "Compare comma-separated sorts (q_sort, list_sort, timsort, "
+                "list_sort_parallel) over runs on queues of size n in the "
+                "given shapes (random, sorted, reverse, partial). "
+                "(default: n == 10000, runs == 10, q_sort,list_sort, random)",
+                "[n] [runs] [sorts] [shapes]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
@@ -1290,6 +2068,8 @@ static void sigsegv_handler(int sig)
 
 static void sigalrm_handler(int sig)
 {
+    if (!time_limit_exceeded())
+        return;
     trigger_exception(
         "Time limit exceeded.  Either you are in an infinite loop, or your "
         "code is too inefficient");
@@ -1335,11 +2115,16 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-m MFILE][-b BFILE]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-m MFILE   Write memory statistics to MFILE at exit\n");
+    printf("\t-b BFILE   Write benchmark records to BFILE, as CSV if its name\n"
+           "\t           ends with .csv and as JSON lines otherwise\n");
     exit(0);
 }
 
@@ -1407,10 +2192,14 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char mbuf[BUFSIZE];
+    char *memstat_name = NULL;
+    char bbuf[BUFSIZE];
+    char *benchfile_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:m:b:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1435,6 +2224,16 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'm':
+            strncpy(mbuf, optarg, BUFSIZE);
+            mbuf[BUFSIZE - 1] = '\0';
+            memstat_name = mbuf;
+            break;
+        case 'b':
+            strncpy(bbuf, optarg, BUFSIZE);
+            bbuf[BUFSIZE - 1] = '\0';
+            benchfile_name = bbuf;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1448,6 +2247,7 @@ int main(int argc, char *argv[])
     srand(os_random(getpid() ^ getppid()));
 
     q_init();
+    latency_init();
     init_cmd();
     console_init();
 
@@ -1465,6 +2265,16 @@ int main(int argc, char *argv[])
         set_echo(true);
     if (logfile_name)
         set_logfile(logfile_name);
+    if (memstat_name && !set_memstat_file(memstat_name)) {
+        fprintf(stderr, "Couldn't open memory statistics file '%s'\n",
+                memstat_name);
+        exit(EXIT_FAILURE);
+    }
+    if (benchfile_name && !set_benchfile(benchfile_name)) {
+        fprintf(stderr, "Couldn't open benchmark file '%s'\n",
+                benchfile_name);
+        exit(EXIT_FAILURE);
+    }
 
     add_quit_helper(q_quit);
 
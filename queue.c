@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "list_sort_template.h"
 #include "queue.h"
+#include "timsort.h"
 
 /* Notice: sometimes, Cppcheck would find the potential NULL pointer bugs,
  * but some of them cannot occur. You can suppress them by adding the
@@ -273,61 +275,156 @@ void q_reverseK(struct list_head *head, int k)
         list_splice_tail(dummy_head, head);
 }
 
-/* Sort elements of queue in ascending/descending order */
-void q_sort(struct list_head *head, bool descend)
+DEFINE_LIST_SORT_PREFETCH(sort_ascend,
+                          element_t,
+                          list,
+                          strcmp(a->value, b->value),
+                          p->value)
+DEFINE_LIST_SORT_PREFETCH(sort_descend,
+                          element_t,
+                          list,
+                          strcmp(b->value, a->value),
+                          p->value)
+
+static int cmp_ascend(void *priv,
+                      const struct list_head *a,
+                      const struct list_head *b)
 {
-    struct list_head left_dummy, right_dummy;
-    struct list_head *slow, *fast, *next;
-    struct list_head *left, *right, *left_head, *right_head;
-    const element_t *left_ele, *right_ele;
+    return strcmp(list_entry(a, element_t, list)->value,
+                  list_entry(b, element_t, list)->value);
+}
 
-    if (!head || list_empty(head) || list_is_singular(head))
-        return;
+static int cmp_descend(void *priv,
+                       const struct list_head *a,
+                       const struct list_head *b)
+{
+    return cmp_ascend(priv, b, a);
+}
 
-    slow = fast = head;
-    while (fast->next != head && fast->next->next != head) {
-        slow = slow->next;
-        fast = fast->next->next;
+/* Number of leading nodes q_sort() inspects to pick an algorithm */
+#define SORT_SAMPLE 256
+/* Lists up to this long are sorted by insertion */
+#define SORT_TINY 16
+/* Natural merging pays off when runs are this long on average */
+#define SORT_MIN_AVG_RUN 16
+/* Strings up to this long are sorted by radix.  Every extra character costs
+ * a pass over the whole list, and beyond 4 merging is faster on large lists.
+ */
+#define SORT_RADIX_MAX_LEN 4
+
+/* Name of the algorithm picked by the last q_sort() call */
+const char *q_sort_choice = "none";
+
+/* Stable insertion sort, for tiny lists */
+static void insertion_sort(struct list_head *head, list_cmp_func_t cmp)
+{
+    struct list_head sorted, *node, *safe;
+
+    INIT_LIST_HEAD(&sorted);
+    list_for_each_safe (node, safe, head) {
+        struct list_head *pos = sorted.prev;
+        while (pos != &sorted && cmp(NULL, pos, node) > 0)
+            pos = pos->prev;
+        list_move(node, pos);
+    }
+    list_splice(&sorted, head);
+}
+
+/* Character at index pos of s, as if s were padded with NUL bytes */
+static unsigned char char_at(const char *s, size_t pos)
+{
+    for (size_t i = 0; i < pos; i++) {
+        if (!s[i])
+            return 0;
+    }
+    return s[pos];
+}
+
+/* Stable LSD radix sort of strings no longer than len.  Padding with NUL
+ * bytes makes a shorter string sort first, as strcmp() does.
+ */
+static void radix_sort(struct list_head *head, size_t len, bool descend)
+{
+    struct list_head buckets[256];
+
+    for (size_t pos = len; pos-- > 0;) {
+        element_t *e, *safe;
+
+        for (int i = 0; i < 256; i++)
+            INIT_LIST_HEAD(&buckets[i]);
+        list_for_each_entry_safe (e, safe, head, list)
+            list_move_tail(&e->list, &buckets[char_at(e->value, pos)]);
+        for (int i = 0; i < 256; i++)
+            list_splice_tail(&buckets[descend ? 255 - i : i], head);
     }
+}
 
-    left_head = &left_dummy;
-    right_head = &right_dummy;
-    INIT_LIST_HEAD(left_head);
-    INIT_LIST_HEAD(right_head);
+/* Sort elements of queue in ascending/descending order.
+ *
+ * A bounded prefix of the queue is sampled to choose the algorithm: insertion
+ * sort for tiny queues, timsort's natural merging when the prefix consists of
+ * few runs in either direction, radix sort when the strings are short, and
+ * a merge sort otherwise.  All of them are stable and none allocates, so this
+ * is safe under set_noallocate_mode().
+ */
+void q_sort(struct list_head *head, bool descend)
+{
+    size_t sampled = 0, ascents = 0, descents = 0, maxlen = 0;
+    const element_t *prev = NULL, *e;
+
+    if (!head || list_empty(head) || list_is_singular(head)) {
+        q_sort_choice = "none";
+        return;
+    }
 
-    list_cut_position(right_head, slow, head->prev);
-    list_splice_init(head, left_head);
+    list_for_each_entry (e, head, list) {
+        if (sampled == SORT_SAMPLE)
+            break;
+        size_t len = strlen(e->value);
+        if (len > maxlen)
+            maxlen = len;
+        if (prev) {
+            int c = strcmp(prev->value, e->value);
+            ascents += c < 0;
+            descents += c > 0;
+        }
+        prev = e;
+        sampled++;
+    }
+    bool complete = &e->list == head;
+    size_t runs = (ascents < descents ? ascents : descents) + 1;
 
-    q_sort(left_head, descend);
-    q_sort(right_head, descend);
+    if (complete && sampled <= SORT_TINY) {
+        q_sort_choice = "insertion";
+        insertion_sort(head, descend ? cmp_descend : cmp_ascend);
+        return;
+    }
 
-    left = left_head->next;
-    right = right_head->next;
-    left_ele = list_entry(left, element_t, list);
-    right_ele = list_entry(right, element_t, list);
+    if (runs * SORT_MIN_AVG_RUN <= sampled) {
+        q_sort_choice = "natural merge";
+        timsort(NULL, head, descend ? cmp_descend : cmp_ascend);
+        return;
+    }
 
-    while (left != left_head && right != right_head) {
-        if ((strcmp(left_ele->value, right_ele->value) <= 0) ^ descend) {
-            next = left->next;
-            list_move_tail(left, head);
-            left = next;
-            if (left == left_head)
-                break;
-            left_ele = list_entry(left, element_t, list);
-        } else {
-            next = right->next;
-            list_move_tail(right, head);
-            right = next;
-            if (right == right_head)
-                break;
-            right_ele = list_entry(right, element_t, list);
+    if (maxlen <= SORT_RADIX_MAX_LEN) {
+        /* The prefix only hints at short strings, so check them all */
+        list_for_each_entry (e, head, list) {
+            size_t len = strnlen(e->value, SORT_RADIX_MAX_LEN + 1);
+            if (len > maxlen)
+                maxlen = len;
+        }
+        if (maxlen <= SORT_RADIX_MAX_LEN) {
+            q_sort_choice = "radix";
+            radix_sort(head, maxlen, descend);
+            return;
         }
     }
 
-    if (!list_empty(left_head))
-        list_splice_tail(left_head, head);
-    if (!list_empty(right_head))
-        list_splice_tail(right_head, head);
+    q_sort_choice = "merge";
+    if (descend)
+        sort_descend(head);
+    else
+        sort_ascend(head);
 }
 
 /* Remove every node which has a node with a strictly less value anywhere to
@@ -17,6 +17,8 @@
 static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
+static FILE *benchfile = NULL;
+static bool bench_csv = false;
 
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
@@ -51,6 +53,78 @@ bool set_logfile(const char *file_name)
     return logfile != NULL;
 }
 
+bool set_benchfile(const char *file_name)
+{
+    size_t len = strlen(file_name);
+    bench_csv = len >= 4 && !strcmp(file_name + len - 4, ".csv");
+    benchfile = fopen(file_name, "w");
+    if (!benchfile)
+        return false;
+
+    if (bench_csv)
+        fprintf(benchfile,
+                "name,params,cycles,ns,allocs,frees,peak_bytes\n");
+    return true;
+}
+
+bool bench_enabled()
+{
+    return benchfile != NULL;
+}
+
+/* Write s as a JSON string or CSV field */
+static void bench_string(const char *s)
+{
+    if (bench_csv) {
+        fputc('"', benchfile);
+        for (; *s; s++) {
+            if (*s == '"')
+                fputc('"', benchfile);
+            fputc(*s, benchfile);
+        }
+        fputc('"', benchfile);
+        return;
+    }
+
+    fputc('"', benchfile);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(benchfile, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(benchfile, "\\u%04x", c);
+        else
+            fputc(c, benchfile);
+    }
+    fputc('"', benchfile);
+}
+
+void report_bench(const bench_record_t *rec)
+{
+    if (!benchfile)
+        return;
+
+    if (bench_csv) {
+        bench_string(rec->name);
+        fputc(',', benchfile);
+        bench_string(rec->params ? rec->params : "");
+        fprintf(benchfile, ",%lld,%lld,%zu,%zu,%zu\n",
+                (long long) rec->cycles, (long long) rec->ns, rec->allocs,
+                rec->frees, rec->peak_bytes);
+    } else {
+        fprintf(benchfile, "{\"name\": ");
+        bench_string(rec->name);
+        fprintf(benchfile, ", \"params\": ");
+        bench_string(rec->params ? rec->params : "");
+        fprintf(benchfile,
+                ", \"cycles\": %lld, \"ns\": %lld, \"allocs\": %zu, "
+                "\"frees\": %zu, \"peak_bytes\": %zu}\n",
+                (long long) rec->cycles, (long long) rec->ns, rec->allocs,
+                rec->frees, rec->peak_bytes);
+    }
+    fflush(benchfile);
+}
+
 void report_event(message_t msg, char *fmt, ...)
 {
     va_list ap;
@@ -95,14 +169,11 @@ void report_event(message_t msg, char *fmt, ...)
     }
 }
 
-#define BUF_SIZE 4096
-extern int web_connfd;
 void report(int level, char *fmt, ...)
 {
     if (!verbfile)
         init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
     if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
@@ -119,14 +190,9 @@ void report(int level, char *fmt, ...)
             va_end(ap);
         }
         va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
+        web_vprintf(fmt, ap);
         va_end(ap);
-    }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
+        web_printf("\n");
     }
 }
 
@@ -135,7 +201,6 @@ void report_noreturn(int level, char *fmt, ...)
     if (!verbfile)
         init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
     if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
@@ -150,12 +215,9 @@ void report_noreturn(int level, char *fmt, ...)
             va_end(ap);
         }
         va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
+        web_vprintf(fmt, ap);
         va_end(ap);
     }
-
-    if (web_connfd)
-        web_send(web_connfd, buffer);
 }
 
 /* Functions denoting failures */
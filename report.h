@@ -3,6 +3,8 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -26,6 +28,29 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* One measurement in structured benchmark output */
+typedef struct {
+    const char *name;   /* Timed command or benchmark */
+    const char *params; /* Its arguments */
+    int64_t cycles;
+    int64_t ns;
+    size_t allocs;     /* Harness allocations during the measurement */
+    size_t frees;      /* Harness frees during the measurement */
+    size_t peak_bytes; /* Peak of harness live bytes */
+} bench_record_t;
+
+/* Emit benchmark records to the named file.
+ * Records are written as CSV if the name ends with ".csv", and as JSON lines
+ * otherwise.
+ */
+bool set_benchfile(const char *file_name);
+
+/* Whether structured benchmark output is enabled */
+bool bench_enabled();
+
+/* Emit one record, if enabled */
+void report_bench(const bench_record_t *rec);
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, const char *fun_name);
 
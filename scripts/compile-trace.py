@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+
+# Compile a qtest command trace into the binary format replayed by console.c,
+# which skips tokenizing and command lookup.  See the comment above
+# trace_varint() there for the layout.
+
+import getopt
+import re
+import sys
+
+MAGIC = b"QTRC"
+VERSION = 1
+RAW = 1
+INT = 1
+
+# Integers that read back as the same text are packed
+intPattern = re.compile(rb"-?(0|[1-9][0-9]*)")
+
+
+def varint(n):
+    out = bytearray()
+    while n >= 0x80:
+        out.append(n & 0x7f | 0x80)
+        n >>= 7
+    out.append(n)
+    return bytes(out)
+
+
+def packArg(tok):
+    """Return the encoding of tok and the bytes it takes once formatted"""
+    if intPattern.fullmatch(tok) and tok != b"-0":
+        v = int(tok)
+        # The zigzag form and the tag must fit in 32 bits
+        if -2**30 <= v < 2**30:
+            zigzag = (v << 1) ^ (v >> 30)
+            return varint(zigzag << 1 | INT), 12
+    return varint(len(tok) << 1) + tok, len(tok) + 1
+
+
+def compileTrace(text):
+    names = {}
+    records = []
+    argBytes = 0
+    lines = text.split(b"\n")
+    if lines and lines[-1] == b"":
+        lines.pop()
+    for line in lines:
+        # bytes.split() breaks on the same characters as isspace() in C
+        tokens = line.split()
+        if not tokens:
+            op, args = 0, []
+        else:
+            name = tokens[0]
+            if name not in names:
+                names[name] = len(names) + 1
+            op, args = names[name], tokens[1:]
+        rec = b""
+        if line != b" ".join(tokens):
+            # Keep the text for echoing, as the tokens lose spacing
+            rec = varint(len(line)) + line
+            op = op << 1 | RAW
+        else:
+            op = op << 1
+        packed = [packArg(a) for a in args]
+        argBytes = max(argBytes, sum(size for _, size in packed))
+        records.append(varint(op) + varint(len(args)) + rec +
+                       b"".join(enc for enc, _ in packed))
+
+    out = [MAGIC, bytes([VERSION]), varint(len(names)), varint(argBytes)]
+    for name in sorted(names, key=names.get):
+        out.append(varint(len(name)) + name)
+    return b"".join(out + records)
+
+
+def usage(name):
+    print("Usage: %s [-h] IN.cmd OUT" % name)
+    print("  -h        Print this message")
+    sys.exit(0)
+
+
+def run(name, args):
+    optlist, args = getopt.getopt(args, 'h')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+    if len(args) != 2:
+        usage(name)
+    with open(args[0], "rb") as f:
+        text = f.read()
+    data = compileTrace(text)
+    with open(args[1], "wb") as f:
+        f.write(data)
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
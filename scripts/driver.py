@@ -4,6 +4,8 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import os
+import tempfile
 
 
 
@@ -17,6 +19,9 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    memStats = False
+    compiled = False
+    harness = False
 
     traceDict = {
         1: "trace-01-ops",
@@ -38,6 +43,16 @@ class Tracer:
         17: "trace-17-complexity"
     }
 
+    # Traces of the features of qtest itself rather than of queue.c.  They
+    # are run with -H and score no points.
+    harnessDict = {
+        18: "trace-18-extsort",
+        19: "trace-19-compiled",
+        20: "trace-20-repeat",
+        21: "trace-21-workload",
+        22: "trace-22-stats"
+    }
+
     traceProbs = {
         1: "Trace-01",
         2: "Trace-02",
@@ -69,50 +84,119 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 memStats=False,
+                 compiled=False,
+                 harness=False):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.memStats = memStats
+        self.compiled = compiled
+        self.harness = harness
+        self.memDict = {}
 
     def printInColor(self, text, color):
         if self.colored == False:
             color = self.WHITE
         print(color, text, self.WHITE, sep = '')
 
+    def traceName(self, tid):
+        return self.traceDict.get(tid) or self.harnessDict.get(tid)
+
     def runTrace(self, tid):
-        if not tid in self.traceDict:
+        if not self.traceName(tid):
             self.printInColor("ERROR: No trace with id %d" % tid, self.RED)
             return False
-        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
+        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceName(tid))
+        if self.compiled:
+            cfd, cname = tempfile.mkstemp(prefix="qtest-trace.")
+            os.close(cfd)
+            compiler = os.path.join(os.path.dirname(__file__), "compile-trace.py")
+            if subprocess.call([sys.executable, compiler, fname, cname]) != 0:
+                os.remove(cname)
+                self.printInColor("ERROR: Could not compile %s" % fname, self.RED)
+                return False
+            fname = cname
         vname = "%d" % self.verbLevel
         clist = self.command + ["-v", vname, "-f", fname]
+        if self.memStats:
+            mfd, mname = tempfile.mkstemp(prefix="qtest-mem.")
+            os.close(mfd)
+            clist += ["-m", mname]
 
         try:
             retcode = subprocess.call(clist)
         except Exception as e:
             self.printInColor("Call of '%s' failed: %s" % (" ".join(clist), e), self.RED)
             return False
+        finally:
+            if self.memStats:
+                self.memDict[tid] = self.parseMemStats(mname)
+                os.remove(mname)
+            if self.compiled:
+                os.remove(fname)
         return retcode == 0
 
+    def parseMemStats(self, mname):
+        stats = {"hist": {}, "cmd": {}}
+        with open(mname) as f:
+            for line in f:
+                fields = line.split()
+                if not fields:
+                    continue
+                if fields[0] == "hist":
+                    stats["hist"][int(fields[1])] = int(fields[2])
+                elif fields[0] == "cmd":
+                    calls, alloc, freed, peak = map(int, fields[2:6])
+                    stats["cmd"][fields[1]] = (calls, alloc, freed, peak)
+                else:
+                    stats[fields[0]] = int(fields[1])
+        return stats
+
+    def printMemStats(self):
+        print("---\tTrace\t\t%10s %14s %12s %10s  %s" %
+              ("Allocs", "Bytes", "Peak", "Leaked", "Top command"))
+        hist = {}
+        for t, stats in self.memDict.items():
+            if "alloc_cnt" not in stats:
+                print("---\t%s\t(no data)" % self.traceName(t))
+                continue
+            for size, cnt in stats["hist"].items():
+                hist[size] = hist.get(size, 0) + cnt
+            top = "-"
+            if stats["cmd"]:
+                name, val = max(stats["cmd"].items(), key=lambda c: c[1][1])
+                top = "%s (%d bytes)" % (name, val[1])
+            print("---\t%s\t%10d %14d %12d %10d  %s" %
+                  (self.traceName(t), stats["alloc_cnt"], stats["alloc_bytes"],
+                   stats["peak_bytes"], stats["live_bytes"], top))
+        print("---\tSize class\tAllocs")
+        for size in sorted(hist.keys()):
+            print("---\t>= %-10d\t%d" % (size, hist[size]))
+
     def run(self, tid=0):
-        scoreDict = {k: 0 for k in self.traceDict.keys()}
-        print("---\tTrace\t\tPoints")
         if tid == 0:
-            tidList = self.traceDict.keys()
+            tidList = (self.harnessDict if self.harness else self.traceDict).keys()
         else:
-            if not tid in self.traceDict:
+            if not self.traceName(tid):
                 self.printInColor("ERROR: Invalid trace ID %d" % tid, self.RED)
                 return
             tidList = [tid]
-        score = 0
-        maxscore = 0
         if self.useValgrind:
             self.command = ['valgrind', self.qtest]
         else:
             self.command = [self.qtest]
+        if tid in self.harnessDict or (tid == 0 and self.harness):
+            self.runHarness(tidList)
+            return
+        scoreDict = {k: 0 for k in self.traceDict.keys()}
+        print("---\tTrace\t\tPoints")
+        score = 0
+        maxscore = 0
         for t in tidList:
             tname = self.traceDict[t]
             if self.verbLevel > 0:
@@ -131,6 +215,8 @@ class Tracer:
             self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.RED)
         else:
             self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.GREEN)
+        if self.memStats:
+            self.printMemStats()
         if self.autograde:
             # Generate JSON string
             jstring = '{"scores": {'
@@ -145,13 +231,37 @@ class Tracer:
         if score < maxscore:
             sys.exit(1)
 
+    def runHarness(self, tidList):
+        print("---\tTrace\t\tResult")
+        failed = 0
+        for t in tidList:
+            tname = self.harnessDict[t]
+            if self.verbLevel > 0:
+                print("+++ TESTING trace %s:" % tname)
+            if self.runTrace(t):
+                self.printInColor("---\t%s\tok" % tname, self.GREEN)
+            else:
+                self.printInColor("---\t%s\tFAILED" % tname, self.RED)
+                failed += 1
+        if failed:
+            self.printInColor("---\tTOTAL\t\t%d failed" % failed, self.RED)
+        else:
+            self.printInColor("---\tTOTAL\t\tok", self.GREEN)
+        if self.memStats:
+            self.printMemStats()
+        if failed:
+            sys.exit(1)
+
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c] [-m] [-b] [-H]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
     print("  -c Enable colored text")
+    print("  -m Collect memory statistics and print a summary table")
+    print("  -b Replay traces compiled by scripts/compile-trace.py")
+    print("  -H Run the unscored traces of qtest itself instead")
     sys.exit(0)
 
 
@@ -163,8 +273,11 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    memStats = False
+    compiled = False
+    harness = False
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:cmbH', ['valgrind'])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -181,6 +294,12 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '-m':
+            memStats = True
+        elif opt == '-b':
+            compiled = True
+        elif opt == '-H':
+            harness = True
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
@@ -190,7 +309,10 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               memStats=memStats,
+               compiled=compiled,
+               harness=harness)
     t.run(tid)
 
 
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+
+# Measure the request rate of the web server of qtest against the number of
+# its worker threads and of concurrent clients, with webbench.  qtest only
+# serves the web from its interactive prompt, so it runs on a pseudo
+# terminal.  Its verbosity is lowered, so the interpreter spends as little as
+# possible on each command and the rate reflects accepting and parsing.
+
+import fcntl
+import getopt
+import os
+import pty
+import select
+import socket
+import struct
+import subprocess
+import sys
+import termios
+import threading
+import time
+
+
+class Qtest:
+
+    def __init__(self, qtest, port, threads):
+        self.pid, self.fd = pty.fork()
+        if self.pid == 0:
+            os.execv(qtest, [qtest])
+        # linenoise probes the width of a terminal that has none
+        fcntl.ioctl(self.fd, termios.TIOCSWINSZ,
+                    struct.pack("HHHH", 24, 80, 0, 0))
+        self.done = False
+        self.tail = b""
+        self.cond = threading.Condition()
+        self.pump = threading.Thread(target=self.drain)
+        self.pump.start()
+        self.wait_prompt(b"")
+        self.send("option verbose 0")
+        self.send("web %d %d" % (port, threads))
+        for _ in range(50):
+            try:
+                socket.create_connection(("127.0.0.1", port)).close()
+                return
+            except OSError:
+                time.sleep(0.1)
+        sys.exit("qtest does not listen on port %d" % port)
+
+    def drain(self):
+        # Answer the cursor position queries of linenoise, and keep the end
+        # of the output to find the prompt
+        while not self.done:
+            ready, _, _ = select.select([self.fd], [], [], 0.1)
+            if not ready:
+                continue
+            try:
+                data = os.read(self.fd, 65536)
+            except OSError:
+                break
+            if not data:
+                break
+            if b"\x1b[6n" in data:
+                os.write(self.fd, b"\x1b[1;1R")
+            with self.cond:
+                self.tail = (self.tail + data)[-256:]
+                self.cond.notify()
+
+    def wait_prompt(self, echo):
+        # Input typed before the prompt is flushed when linenoise switches
+        # the terminal to raw mode.  The prompt is also redrawn while the
+        # line is echoed, so it only counts once the line is complete.
+        def ready():
+            return echo in self.tail and self.tail.endswith(b"cmd> ")
+        with self.cond:
+            if not self.cond.wait_for(ready, 5):
+                sys.exit("qtest does not show its prompt")
+
+    def send(self, line):
+        with self.cond:
+            self.tail = b""
+        os.write(self.fd, line.encode() + b"\r")
+        self.wait_prompt(line.encode())
+
+    def quit(self):
+        os.write(self.fd, b"quit\r")
+        self.done = True
+        self.pump.join()
+        try:
+            os.waitpid(self.pid, 0)
+        except ChildProcessError:
+            pass
+
+
+def bench(webbench, port, conns, requests, extra):
+    cmd = [webbench, "-p", str(port), "-c", str(conns), "-t",
+           str(min(conns, os.cpu_count() or 1)), "-n", str(requests)] + extra
+    out = subprocess.run(cmd, stdout=subprocess.PIPE, text=True).stdout
+    for line in out.splitlines():
+        if line.endswith("requests/s"):
+            return float(line.split()[2])
+    sys.exit("webbench failed:\n" + out)
+
+
+def usage(name):
+    print("Usage: %s [-h] [-p PORT] [-n REQUESTS] [-w LIST] [-c LIST] [-C]"
+          % name)
+    print("  -h          Print this message")
+    print("  -p PORT     Port to listen on (default 9999)")
+    print("  -n REQUESTS Requests per measurement (default 20000)")
+    print("  -w LIST     Worker threads of qtest (default 1,2,4)")
+    print("  -c LIST     Concurrent clients (default 1,16,64,256)")
+    print("  -C          Open a new connection for every request")
+    sys.exit(0)
+
+
+def run(name, args):
+    port, requests = 9999, 20000
+    workers, clients = [1, 2, 4], [1, 16, 64, 256]
+    extra = []
+    optlist, args = getopt.getopt(args, 'hp:n:w:c:C')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-p':
+            port = int(val)
+        elif opt == '-n':
+            requests = int(val)
+        elif opt == '-w':
+            workers = [int(w) for w in val.split(",")]
+        elif opt == '-c':
+            clients = [int(c) for c in val.split(",")]
+        elif opt == '-C':
+            extra.append("-C")
+
+    print("%-8s" % "workers" + "".join("%12s" % ("%d clients" % c)
+                                       for c in clients))
+    for w in workers:
+        qtest = Qtest("./qtest", port, w)
+        rates = [bench("./webbench", port, c, requests, extra)
+                 for c in clients]
+        qtest.quit()
+        print("%-8d" % w + "".join("%12.0f" % r for r in rates))
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
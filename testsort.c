@@ -1,191 +1,410 @@
+/* Benchmark of the list sorts, printed as CSV for plotting scaling curves.
+ *
+ * Every sort runs on queues of element_t, the same shape q_sort handles in
+ * qtest.  For each input distribution and size, the input is relinked in its
+ * original order before every repetition, so all sorts start from the same
+ * memory layout.  Repetitions are preceded by unmeasured warmup runs, and
+ * the median and 95th percentile of the cycle counts are reported together
+ * with the number of comparisons and, when perf_event_open(2) is available,
+ * the medians of the other hardware counters of perf_counter.h.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#include "dudect/cpucycles.h"
 #include "list.h"
 #include "list_sort.h"
+#include "perf_counter.h"
 #include "timsort.h"
 
-#define ELE_SIZE 10000
-#define MAX_NAME_SIZE 64
+/* Use the library allocator instead of the harness' */
+#define INTERNAL 1
+#include "queue.h"
 
-static int array[ELE_SIZE];
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
-struct element {
-    struct list_head list;
-    int val;
-};
+#define MIN_SIZE 1000
+#define DEFAULT_MAX_SIZE 100000
+#define DEFAULT_REPS 7
+#define DEFAULT_WARMUP 1
 
-typedef void (*sample_func)(struct list_head *);
+/* Length of ascending runs in the "runs" distribution */
+#define RUN_LENGTH 100
+/* Distinct keys in the "few-unique" distribution */
+#define FEW_UNIQUE 16
+/* Longest value in the "strings" distribution */
+#define MAX_STRLEN 32
+/* Width of the zero-padded numeric keys, so strcmp() orders numerically */
+#define KEY_WIDTH 10
 
-/*struct sample_type {
-    sample_func func;
-    char name[MAX_NAME_SIZE];
-};*/
+/* queue.c is built against the harness allocator */
+void *test_malloc(size_t size)
+{
+    return malloc(size);
+}
 
-int cmp(void *priv, const struct list_head *a, const struct list_head *b)
+void *test_calloc(size_t nmemb, size_t size)
 {
-    (*(int *) priv)++;
-    return list_entry(a, struct element, list)->val -
-           list_entry(b, struct element, list)->val;
+    return calloc(nmemb, size);
 }
 
-int ascending_arr(const void *a, const void *b)
+void test_free(void *p)
 {
-    return *(const int *) a - *(const int *) b;
+    free(p);
 }
 
-static void free_list(struct list_head *head)
+char *test_strdup(const char *s)
 {
-    struct element *curr, *next;
-    list_for_each_entry_safe (curr, next, head, list)
-        free(curr);
-    free(head);
+    return strdup(s);
 }
 
-static void copy_array_to_list(struct list_head *head)
+static uint64_t rng_state = 88172645463325252ULL;
+
+/* xorshift64, so inputs are reproducible for a given seed */
+static uint64_t rng(void)
 {
-    struct element *curr;
-    int i = 0;
-    list_for_each_entry (curr, head, list) {
-        if (i >= ELE_SIZE)
-            return;
-        curr->val = array[i++];
-    }
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
 }
 
-static struct list_head *create_list(void)
+static int cmp_count(void *priv,
+                     const struct list_head *a,
+                     const struct list_head *b)
 {
-    struct list_head *head = malloc(sizeof(struct list_head));
-    int i;
+    (*(size_t *) priv)++;
+    return strcmp(list_entry(a, element_t, list)->value,
+                  list_entry(b, element_t, list)->value);
+}
 
-    INIT_LIST_HEAD(head);
-    for (i = 0; i < ELE_SIZE; i++) {
-        struct element *e = malloc(sizeof(struct element));
-        list_add_tail(&e->list, head);
-    }
-    return head;
+static int cmp_uint(const void *a, const void *b)
+{
+    uint32_t va = *(const uint32_t *) a, vb = *(const uint32_t *) b;
+
+    return (va > vb) - (va < vb);
 }
 
-static void gen_rand_array(void)
+/* Sorts return the number of comparisons, or -1 when it is not observable */
+static long sort_q_sort(struct list_head *head)
 {
-    int i;
+    q_sort(head, false);
+    return -1;
+}
 
-    for (i = 0; i < ELE_SIZE; i++)
-        array[i] = rand();
+static long sort_list_sort(struct list_head *head)
+{
+    size_t count = 0;
+    list_sort(&count, head, cmp_count);
+    return count;
 }
 
-static inline void swap_array(const int i, const int j)
+static long sort_timsort(struct list_head *head)
 {
-    int temp = array[i];
-    array[i] = array[j];
-    array[j] = temp;
+    size_t count = 0;
+    timsort(&count, head, cmp_count);
+    return count;
 }
 
-static void reverse(int start, int end)
+static int nthreads;
+
+/* Comparisons would race between threads, so they are not counted */
+static int cmp_plain(void *priv,
+                     const struct list_head *a,
+                     const struct list_head *b)
 {
-    while (start < end)
-        swap_array(start++, end--);
+    return strcmp(list_entry(a, element_t, list)->value,
+                  list_entry(b, element_t, list)->value);
 }
 
-static void shuffle_array(void)
+static long sort_list_sort_parallel(struct list_head *head)
 {
-    int i;
+    list_sort_parallel(NULL, head, cmp_plain, nthreads);
+    return -1;
+}
 
-    i = 0;
-    for (;;) {
-        int j, n;
-        n = rand() % 100;
-        j = i + n;
-        if (j >= ELE_SIZE)
-            return;
-        reverse(i, j);
-        i = j + 1;
-    }
+static const struct {
+    const char *name;
+    long (*sort)(struct list_head *head);
+} sorts[] = {
+    {"q_sort", sort_q_sort},
+    {"list_sort", sort_list_sort},
+    {"timsort", sort_timsort},
+    {"list_sort_parallel", sort_list_sort_parallel},
+};
+
+/* Numeric distributions fill keys[0..n) */
+static void gen_random(uint32_t *keys, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        keys[i] = rng() >> 33;
 }
 
-int main(void)
+static void gen_sorted(uint32_t *keys, size_t n)
 {
-    struct list_head *data1, *data2;
-    int before, after, cmp_count;
+    for (size_t i = 0; i < n; i++)
+        keys[i] = i;
+}
 
-    srand(getpid() ^ getppid());
+static void gen_reverse(uint32_t *keys, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        keys[i] = n - i;
+}
 
-    gen_rand_array();
-    data1 = create_list();
-    data2 = create_list();
-    printf("timsort: cpu time, cmp count   |");
-    printf("   list sort: cpu time, cmp count\n");
+static void gen_organ_pipe(uint32_t *keys, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        keys[i] = i < n / 2 ? i : n - i;
+}
 
-    copy_array_to_list(data1);
-    copy_array_to_list(data2);
+static void gen_few_unique(uint32_t *keys, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        keys[i] = rng() % FEW_UNIQUE;
+}
 
-    cmp_count = 0;
-    before = cpucycles();
-    timsort(&cmp_count, data1, cmp);
-    after = cpucycles();
-    printf("   random : %d, %d   |   ", after - before, cmp_count);
+static void gen_runs(uint32_t *keys, size_t n)
+{
+    gen_random(keys, n);
+    for (size_t i = 0; i < n; i += RUN_LENGTH) {
+        size_t len = n - i < RUN_LENGTH ? n - i : RUN_LENGTH;
+        qsort(keys + i, len, sizeof(*keys), cmp_uint);
+    }
+}
 
-    cmp_count = 0;
-    before = cpucycles();
-    list_sort(&cmp_count, data2, cmp);
-    after = cpucycles();
-    printf("%d, %d\n", after - before, cmp_count);
+static const struct {
+    const char *name;
+    void (*gen)(uint32_t *keys, size_t n); /* NULL for strings */
+} dists[] = {
+    {"random", gen_random},         {"sorted", gen_sorted},
+    {"reverse", gen_reverse},       {"organ-pipe", gen_organ_pipe},
+    {"few-unique", gen_few_unique}, {"runs", gen_runs},
+    {"strings", NULL},
+};
 
-    qsort(array, ELE_SIZE, sizeof(int), ascending_arr);
-    reverse(0, ELE_SIZE - 1);
+struct input {
+    size_t n;
+    element_t *nodes;
+    char *pool;
+};
 
-    cmp_count = 0;
-    before = cpucycles();
-    timsort(&cmp_count, data1, cmp);
-    after = cpucycles();
-    printf("   sorted : %d, %d   |   ", after - before, cmp_count);
+/* Build the values of distribution d in a single pool of strings */
+static bool input_init(struct input *in, size_t d, size_t n)
+{
+    size_t width = dists[d].gen ? KEY_WIDTH : MAX_STRLEN;
+    uint32_t *keys = NULL;
+
+    in->n = n;
+    in->nodes = malloc(n * sizeof(element_t));
+    in->pool = malloc(n * (width + 1));
+    if (dists[d].gen)
+        keys = malloc(n * sizeof(*keys));
+    if (!in->nodes || !in->pool || (dists[d].gen && !keys)) {
+        free(in->nodes);
+        free(in->pool);
+        free(keys);
+        return false;
+    }
 
-    cmp_count = 0;
-    before = cpucycles();
-    list_sort(&cmp_count, data2, cmp);
-    after = cpucycles();
-    printf("%d, %d\n", after - before, cmp_count);
+    if (keys)
+        dists[d].gen(keys, n);
+    for (size_t i = 0; i < n; i++) {
+        char *s = in->pool + i * (width + 1);
+        if (keys) {
+            snprintf(s, width + 1, "%0*" PRIu32, KEY_WIDTH, keys[i]);
+        } else {
+            size_t len = 1 + rng() % MAX_STRLEN;
+            for (size_t j = 0; j < len; j++)
+                s[j] = 'a' + rng() % 26;
+            s[len] = '\0';
+        }
+        in->nodes[i].value = s;
+    }
+    free(keys);
+    return true;
+}
 
+static void input_free(struct input *in)
+{
+    free(in->nodes);
+    free(in->pool);
+}
 
-    shuffle_array();
-    copy_array_to_list(data1);
-    copy_array_to_list(data2);
+/* Link the nodes into head in their original order */
+static void input_link(struct input *in, struct list_head *head)
+{
+    INIT_LIST_HEAD(head);
+    for (size_t i = 0; i < in->n; i++)
+        list_add_tail(&in->nodes[i].list, head);
+}
 
-    cmp_count = 0;
-    before = cpucycles();
-    timsort(&cmp_count, data1, cmp);
-    after = cpucycles();
-    printf("sim practice : %d, %d   |   ", after - before, cmp_count);
+static bool check_sorted(struct list_head *head, size_t n)
+{
+    const element_t *prev = NULL, *e;
+    size_t count = 0;
+
+    list_for_each_entry (e, head, list) {
+        if (prev && strcmp(prev->value, e->value) > 0)
+            return false;
+        prev = e;
+        count++;
+    }
+    return count == n;
+}
 
-    cmp_count = 0;
-    before = cpucycles();
-    list_sort(&cmp_count, data2, cmp);
-    after = cpucycles();
-    printf("%d, %d\n", after - before, cmp_count);
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t va = *(const int64_t *) a, vb = *(const int64_t *) b;
 
-    struct element *e = NULL;
-    int i;
+    return (va > vb) - (va < vb);
+}
 
-    qsort(array, ELE_SIZE, sizeof(int), ascending_arr);
-    i = 0;
-    list_for_each_entry (e, data1, list) {
-        if (array[i++] != e->val) {
-            printf("Timsort Not Match!\n");
+/* Value below which p percent of the sorted samples fall */
+static int64_t percentile(const int64_t *samples, int n, int p)
+{
+    int idx = (p * n + 99) / 100 - 1;
+    return samples[idx < 0 ? 0 : idx];
+}
+
+static void usage(const char *cmd)
+{
+    printf("Usage: %s [-h] [-n MAX] [-r REPS] [-w WARMUP] [-s SEED] "
+           "[-t THREADS] [-d DIST]\n",
+           cmd);
+    printf("\t-h         Print this information\n");
+    printf("\t-n MAX     Largest size, sizes grow tenfold from %d (default "
+           "%d)\n",
+           MIN_SIZE, DEFAULT_MAX_SIZE);
+    printf("\t-r REPS    Measured repetitions per case (default %d)\n",
+           DEFAULT_REPS);
+    printf("\t-w WARMUP  Unmeasured repetitions per case (default %d)\n",
+           DEFAULT_WARMUP);
+    printf("\t-s SEED    Seed of the input generator\n");
+    printf("\t-t THREADS Threads of list_sort_parallel (default: online "
+           "CPUs)\n");
+    printf("\t-d DIST    Only run the given input distribution\n");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max_size = DEFAULT_MAX_SIZE;
+    const char *only_dist = NULL;
+    int reps = DEFAULT_REPS, warmup = DEFAULT_WARMUP;
+    bool ok = true;
+    int c;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((c = getopt(argc, argv, "hn:r:w:s:t:d:")) != -1) {
+        switch (c) {
+        case 'n':
+            max_size = strtoul(optarg, NULL, 10);
             break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 's':
+            rng_state = strtoull(optarg, NULL, 10) | 1;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            only_dist = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
         }
     }
+    if (reps < 1) {
+        fprintf(stderr, "At least one repetition is needed\n");
+        return 1;
+    }
 
-    i = 0;
-    list_for_each_entry (e, data2, list) {
-        if (array[i++] != e->val) {
-            printf("Listsort Not Match!\n");
-            break;
+    int64_t *samples[PERF_NR_EVENTS];
+    perf_sample_t sample;
+    perf_counter_t pc;
+
+    if (!perf_open(&pc))
+        fprintf(stderr, "No hardware counters, falling back to cpucycles()\n");
+    samples[0] = malloc(PERF_NR_EVENTS * reps * sizeof(int64_t));
+    if (!samples[0])
+        return 1;
+    for (int e = 1; e < PERF_NR_EVENTS; e++)
+        samples[e] = samples[e - 1] + reps;
+
+    printf("sort,dist,n,reps,median_cycles,p95_cycles,cmps");
+    for (int e = PERF_CYCLES + 1; e < PERF_NR_EVENTS; e++)
+        printf(",%s", perf_event_name(e));
+    printf("\n");
+    for (size_t n = MIN_SIZE; n <= max_size; n *= 10) {
+        for (size_t d = 0; d < ARRAY_SIZE(dists); d++) {
+            struct input in;
+            struct list_head head;
+
+            if (only_dist && strcmp(only_dist, dists[d].name))
+                continue;
+            if (!input_init(&in, d, n)) {
+                fprintf(stderr, "Fail to allocate %zu elements\n", n);
+                free(samples[0]);
+                return 1;
+            }
+
+            for (size_t s = 0; s < ARRAY_SIZE(sorts); s++) {
+                long cmps = 0;
+
+                for (int i = 0; i < warmup; i++) {
+                    input_link(&in, &head);
+                    sorts[s].sort(&head);
+                }
+                for (int i = 0; i < reps; i++) {
+                    input_link(&in, &head);
+                    perf_start(&pc);
+                    cmps = sorts[s].sort(&head);
+                    perf_stop(&pc, &sample);
+                    for (int e = 0; e < PERF_NR_EVENTS; e++)
+                        samples[e][i] = sample.count[e];
+                }
+
+                if (!check_sorted(&head, n)) {
+                    fprintf(stderr, "%s fails on %s input of %zu elements\n",
+                            sorts[s].name, dists[d].name, n);
+                    ok = false;
+                }
+
+                for (int e = 0; e < PERF_NR_EVENTS; e++)
+                    qsort(samples[e], reps, sizeof(int64_t), cmp_int64);
+                printf("%s,%s,%zu,%d,%" PRId64 ",%" PRId64 ",", sorts[s].name,
+                       dists[d].name, n, reps,
+                       percentile(samples[PERF_CYCLES], reps, 50),
+                       percentile(samples[PERF_CYCLES], reps, 95));
+                if (cmps >= 0)
+                    printf("%ld", cmps);
+                for (int e = PERF_CYCLES + 1; e < PERF_NR_EVENTS; e++) {
+                    printf(",");
+                    if (sample.valid[e])
+                        printf("%" PRId64, percentile(samples[e], reps, 50));
+                }
+                printf("\n");
+                fflush(stdout);
+            }
+            input_free(&in);
         }
     }
 
-    free_list(data1);
-    free_list(data2);
-    return 0;
+    perf_close(&pc);
+    free(samples[0]);
+    return ok ? 0 : 1;
 }
@@ -1,208 +1,394 @@
-#include <stdio.h>
-#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 
 #include "list.h"
 #include "timsort.h"
 
-#define MIN_RUN_SIZE 5
+/*
+ * Timsort for doubly-linked lists, following the description of listsort in
+ * CPython's Objects/listsort.txt.
+ *
+ * While sorting, every run is a null-terminated singly-linked list described
+ * by its first and last nodes and its length; prev pointers are rebuilt at
+ * the end.  Pending runs are kept in a fixed array inside struct sort_state
+ * on the caller's stack, so sorting never allocates memory.
+ *
+ * Linked lists gain nothing from galloping in terms of data movement, but the
+ * exponential and binary searches still cut the number of comparisons, which
+ * dominate when comparing strings.
+ */
+
+/* Runs shorter than this are extended by binary insertion */
+#define MIN_MERGE 64
+
+/* Initial threshold for entering galloping mode */
+#define MIN_GALLOP 7
+
+/*
+ * Upper bound on pending runs.  The merge_collapse() invariants make run
+ * lengths grow at least as fast as the Fibonacci numbers from the top of the
+ * stack down, so the stack is at most log_phi(n) deep; 85 covers any n that
+ * fits in 64 bits, as in CPython.
+ */
+#define MAX_PENDING 85
 
 struct run {
-    struct list_head head;  // head of run
-    struct list_head list;  // used to connect runs_queue
+    struct list_head *head, *tail; /* a null-terminated list */
     size_t size;
 };
 
-struct runs_queue {
-    struct list_head head;
+struct sort_state {
+    void *priv;
+    list_cmp_func_t cmp;
+    size_t min_gallop;
     size_t count;
+    struct run runs[MAX_PENDING];
 };
 
-static struct run *new_run(struct list_head *head)
+/*
+ * Take n, if less than MIN_MERGE, else the six most significant bits of n,
+ * plus one if any of the remaining bits is set.  n / minrun is then a power
+ * of two or slightly less, which keeps the final merges balanced.
+ */
+static size_t compute_minrun(size_t n)
 {
-    struct run *run = calloc(1, sizeof(struct run));
-    if (!run) {
-        printf("Fail to construct new run\n");
-        return NULL;
-    }
+    size_t r = 0;
 
-    INIT_LIST_HEAD(&run->head);
-    INIT_LIST_HEAD(&run->list);
-    return run;
-}
-
-static void free_run(struct run *run)
-{
-    free(run);
+    while (n >= MIN_MERGE) {
+        r |= n & 1;
+        n >>= 1;
+    }
+    return n + r;
 }
 
-static struct runs_queue *new_runs_queue()
+/*
+ * Count the leading nodes of @list (@n nodes long) that belong before @key:
+ * the nodes less than or equal to @key if @right, else those strictly less.
+ * The last of them is stored in @lastp.
+ *
+ * Offsets 0, 1, 3, 7, ... are probed first, then the remaining gap is
+ * bisected.  Each bisection step walks from the low end of the gap, so the
+ * pointer chasing stays linear in the result while the number of comparisons
+ * is logarithmic.
+ */
+static size_t gallop(void *priv,
+                     list_cmp_func_t cmp,
+                     const struct list_head *key,
+                     struct list_head *list,
+                     size_t n,
+                     bool right,
+                     struct list_head **lastp)
 {
-    struct runs_queue *rq = calloc(1, sizeof(*rq));
+    struct list_head *last = NULL, *node = list, *lo_node = list;
+    size_t lo = 0, hi = n, pos = 0, ofs = 0;
+
+    /* Exponential search: find lo < hi with [0, lo) before key and hi not */
+    while (ofs < n) {
+        while (pos < ofs) {
+            node = node->next;
+            pos++;
+        }
+        int c = cmp(priv, node, key);
+        if (right ? c > 0 : c >= 0) {
+            hi = ofs;
+            break;
+        }
+        last = node;
+        lo = ofs + 1;
+        lo_node = node->next;
+        ofs = (ofs << 1) + 1;
+    }
 
-    if (!rq) {
-        printf("Fail to construct new queue of runs\n");
-        return NULL;
+    /* Binary search within [lo, hi) */
+    while (lo < hi) {
+        size_t mid = lo + ((hi - lo) >> 1);
+        node = lo_node;
+        for (pos = lo; pos < mid; pos++)
+            node = node->next;
+        int c = cmp(priv, node, key);
+        if (right ? c > 0 : c >= 0) {
+            hi = mid;
+        } else {
+            last = node;
+            lo = mid + 1;
+            lo_node = node->next;
+        }
     }
 
-    INIT_LIST_HEAD(&rq->head);
-    return rq;
+    *lastp = last;
+    return lo;
 }
 
-static void free_runs_queue(struct runs_queue *rq)
+/*
+ * Merge run @b into run @a, taking from @a on ties for stability.  Runs
+ * already in order are concatenated in O(1) thanks to the tail pointers.
+ * Otherwise, once one side wins min_gallop times in a row, switch to
+ * galloping: find with gallop() how many nodes can be taken from each side at
+ * once, and stay in that mode while it pays off.  min_gallop adapts to the
+ * data, dropping while galloping works and rising when it does not.
+ */
+static void merge(struct sort_state *st, struct run *a, const struct run *b)
 {
-    if (!rq)
+    void *priv = st->priv;
+    list_cmp_func_t cmp = st->cmp;
+    struct list_head *head, **tail = &head, *last;
+    struct list_head *pa = a->head, *pb = b->head;
+    size_t na = a->size, nb = b->size, acount = 0, bcount = 0;
+
+    a->size += b->size;
+    if (cmp(priv, b->head, a->tail) >= 0) {
+        a->tail->next = b->head;
+        a->tail = b->tail;
         return;
+    }
+    if (cmp(priv, b->tail, a->head) < 0) {
+        b->tail->next = a->head;
+        a->head = b->head;
+        return;
+    }
 
-    struct run *run, *next;
-    list_for_each_entry_safe (run, next, &rq->head, list)
-        free_run(run);
-    free(rq);
+    for (;;) {
+        /* One pair at a time until a side keeps winning */
+        while (na && nb) {
+            if (cmp(priv, pb, pa) < 0) {
+                *tail = pb;
+                tail = &pb->next;
+                pb = pb->next;
+                nb--;
+                acount = 0;
+                if (++bcount >= st->min_gallop)
+                    break;
+            } else {
+                *tail = pa;
+                tail = &pa->next;
+                pa = pa->next;
+                na--;
+                bcount = 0;
+                if (++acount >= st->min_gallop)
+                    break;
+            }
+        }
+        if (!na || !nb)
+            break;
+
+        /* Galloping mode */
+        do {
+            if (st->min_gallop > 1)
+                st->min_gallop--;
+
+            acount = gallop(priv, cmp, pb, pa, na, true, &last);
+            if (acount) {
+                *tail = pa;
+                tail = &last->next;
+                pa = last->next;
+                na -= acount;
+                if (!na)
+                    goto done;
+            }
+            *tail = pb;
+            tail = &pb->next;
+            pb = pb->next;
+            if (!--nb)
+                goto done;
+
+            bcount = gallop(priv, cmp, pa, pb, nb, false, &last);
+            if (bcount) {
+                *tail = pb;
+                tail = &last->next;
+                pb = last->next;
+                nb -= bcount;
+                if (!nb)
+                    goto done;
+            }
+            *tail = pa;
+            tail = &pa->next;
+            pa = pa->next;
+            if (!--na)
+                goto done;
+        } while (acount >= MIN_GALLOP || bcount >= MIN_GALLOP);
+
+        /* Penalize leaving galloping mode */
+        st->min_gallop++;
+        acount = bcount = 0;
+    }
+
+done:
+    /* What is left of either run is already null-terminated */
+    if (na) {
+        *tail = pa;
+    } else {
+        *tail = pb;
+        a->tail = b->tail;
+    }
+    a->head = head;
 }
 
 /*
- * @head1: one of header of list on runs_queue
- * @head2: another header of list on runs_queue
- *
- * two runs will be merged and link to head1,
- * then free the space of run #2.
+ * Extend @run with up to @extra nodes taken from @rest, placing each by
+ * binary search.  The run is held in an array of node pointers for the
+ * duration, so locating a node costs O(log size) comparisons instead of a
+ * scan.  Return the remaining input.
  */
-static void merge(void *priv,
-                  struct list_head *head1,
-                  struct list_head *head2,
-                  list_cmp_func_t cmp)
+static struct list_head *binary_insertion(struct sort_state *st,
+                                          struct run *run,
+                                          struct list_head *rest,
+                                          size_t extra)
 {
-    struct run *run1, *run2;
-    struct list_head temp, *run1_head, *run2_head;
-
-    INIT_LIST_HEAD(&temp);
-
-    run1 = list_entry(head1, struct run, list);
-    run2 = list_entry(head2, struct run, list);
-    run1_head = &run1->head;
-    run2_head = &run2->head;
-
-    while (!list_empty(run1_head) && !list_empty(run2_head)) {
-        struct list_head *cut;
-        if (cmp(priv, run1_head->next, run2_head->next) <= 0)
-            cut = run1_head->next;
-        else
-            cut = run2_head->next;
-
-        list_del(cut);
-        list_add_tail(cut, &temp);
+    struct list_head *nodes[MIN_MERGE];
+    size_t n = 0;
+
+    for (struct list_head *node = run->head; node; node = node->next)
+        nodes[n++] = node;
+
+    while (extra-- && rest) {
+        struct list_head *node = rest;
+        size_t lo = 0, hi = n;
+
+        rest = rest->next;
+        /* Insert after equal nodes to keep the sort stable */
+        while (lo < hi) {
+            size_t mid = lo + ((hi - lo) >> 1);
+            if (st->cmp(st->priv, node, nodes[mid]) < 0)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        memmove(&nodes[lo + 1], &nodes[lo], (n - lo) * sizeof(nodes[0]));
+        nodes[lo] = node;
+        n++;
     }
 
-    list_splice_tail_init(run1_head, &temp);
-    list_splice_tail(run2_head, &temp);
-    list_splice_tail(&temp, run1_head);
-    run1->size += run2->size;
-
-    list_del(head2);  // remove run #2 from all_run
-    free_run(run2);
+    for (size_t i = 0; i + 1 < n; i++)
+        nodes[i]->next = nodes[i + 1];
+    nodes[n - 1]->next = NULL;
+    run->head = nodes[0];
+    run->tail = nodes[n - 1];
+    run->size = n;
+    return rest;
 }
 
 /*
- * suppose there are n runs, index are from 0, 1, ..., n-1.
- * keep merging (0 and n-1), (1 and n-2), and so on till only 1 run remaind.
+ * Detach the next run from the front of @list into @run.  A strictly
+ * descending run is reversed in place; strictness guarantees that reversing
+ * keeps the sort stable.  Runs shorter than @minrun are extended with binary
+ * insertion.  Return the remaining input.
  */
-static void final_merge(void *priv,
-                        struct runs_queue *all_run,
-                        list_cmp_func_t cmp)
+static struct list_head *next_run(struct sort_state *st,
+                                  struct run *run,
+                                  struct list_head *list,
+                                  size_t minrun)
 {
-    struct list_head *head, *left, *right;
-
-    head = &all_run->head;
-    while (all_run->count > 1) {
-        int merge_count = all_run->count >> 1;
-        for (left = head->next; merge_count-- > 0; left = left->next) {
-            right = head->prev;
-            merge(priv, left, right, cmp);
+    struct list_head *head = list, *tail = list, *curr = list->next;
+    size_t size = 1;
+
+    if (curr && st->cmp(st->priv, curr, head) < 0) {
+        do {
+            struct list_head *next = curr->next;
+            curr->next = head;
+            head = curr;
+            curr = next;
+            size++;
+        } while (curr && st->cmp(st->priv, curr, head) < 0);
+    } else {
+        while (curr && st->cmp(st->priv, curr, tail) >= 0) {
+            tail = curr;
+            curr = curr->next;
+            size++;
         }
-        all_run->count = (all_run->count + 1) >> 1;
     }
+    tail->next = NULL;
+
+    run->head = head;
+    run->tail = tail;
+    run->size = size;
+    if (size < minrun && curr)
+        curr = binary_insertion(st, run, curr, minrun - size);
+    return curr;
 }
 
-static void insertion(void *priv,
-                      struct list_head *head,
-                      struct list_head *new_node,
-                      list_cmp_func_t cmp)
+/* Merge runs[i + 1] into runs[i] and drop it from the stack */
+static void merge_at(struct sort_state *st, size_t i)
 {
-    struct list_head *right;
+    merge(st, &st->runs[i], &st->runs[i + 1]);
+    if (i + 2 < st->count)
+        st->runs[i + 1] = st->runs[i + 2];
+    st->count--;
+}
 
-    list_for_each (right, head) {
-        if (cmp(priv, right, new_node) > 0)
+/*
+ * Keep the invariants on the lengths of the four topmost runs A, B, C, D
+ * (D the newest):
+ *   A > B + C,  B > C + D,  C > D
+ * Checking the two deepest conditions, not only the top three runs, is the
+ * fix for the bug reported by de Gouw et al. in 2015.  The invariants bound
+ * the stack depth by log_phi(n) and keep merges balanced.
+ */
+static void merge_collapse(struct sort_state *st)
+{
+    struct run *r = st->runs;
+
+    while (st->count > 1) {
+        size_t n = st->count - 2;
+
+        if ((n > 0 && r[n - 1].size <= r[n].size + r[n + 1].size) ||
+            (n > 1 && r[n - 2].size <= r[n - 1].size + r[n].size)) {
+            if (r[n - 1].size < r[n + 1].size)
+                n--;
+        } else if (r[n].size > r[n + 1].size) {
             break;
+        }
+        merge_at(st, n);
     }
-    list_del(new_node);
-    list_add_tail(new_node, right);
 }
 
-static struct run *next_run(void *priv,
-                            struct list_head *head,
-                            list_cmp_func_t cmp)
+/* Merge whatever is left on the stack, favoring the smaller neighbor */
+static void merge_force_collapse(struct sort_state *st)
 {
-    struct run *run;
-    struct list_head *curr, *next;
-
-    run = new_run(head);
-    run->size = 1;
-
-    curr = head->next;
-    next = head->next->next;
-    while (next != head && cmp(priv, curr, next) <= 0) {
-        curr = next;
-        next = next->next;
-        run->size++;
-    }
-    list_cut_position(&run->head, head, curr);
+    struct run *r = st->runs;
 
-    list_for_each_safe (curr, next, head) {
-        if (run->size >= MIN_RUN_SIZE)
-            break;
+    while (st->count > 1) {
+        size_t n = st->count - 2;
 
-        insertion(priv, &run->head, curr, cmp);
-        run->size++;
+        if (n > 0 && r[n - 1].size < r[n + 1].size)
+            n--;
+        merge_at(st, n);
     }
-
-    return run;
 }
 
 void timsort(void *priv, struct list_head *head, list_cmp_func_t cmp)
 {
-    struct runs_queue *all_run = new_runs_queue();
-    struct run *run;
-
-    while (!list_empty(head)) {
-        run = next_run(priv, head, cmp);
-        list_add_tail(&run->list, &all_run->head);
-        if (++all_run->count < 4)
-            continue;
-
-        struct list_head *a, *b, *c, *d;
-        struct run *ra, *rb, *rc, *rd;
-
-        a = all_run->head.prev;
-        b = all_run->head.prev->prev;
-        c = all_run->head.prev->prev->prev;
-        d = all_run->head.prev->prev->prev->prev;
-
-        ra = list_entry(a, struct run, list);
-        rb = list_entry(b, struct run, list);
-        rc = list_entry(c, struct run, list);
-        rd = list_entry(d, struct run, list);
-
-        if (ra->size <= rb->size + rc->size ||
-            rb->size <= rc->size + rd->size) {
-            if (rb->size < rd->size)
-                merge(priv, b, c, cmp);
-            else
-                merge(priv, c, d, cmp);
+    struct sort_state st = {
+        .priv = priv,
+        .cmp = cmp,
+        .min_gallop = MIN_GALLOP,
+        .count = 0,
+    };
+    struct list_head *list, *tail;
+    size_t n = 0;
+
+    list_for_each (list, head)
+        n++;
+    if (n < 2)
+        return;
 
-            all_run->count--;
-        }
+    size_t minrun = compute_minrun(n);
+
+    /* Convert to a null-terminated singly-linked list */
+    head->prev->next = NULL;
+    list = head->next;
+    while (list) {
+        list = next_run(&st, &st.runs[st.count++], list, minrun);
+        merge_collapse(&st);
+    }
+    merge_force_collapse(&st);
+
+    /* Rebuild prev links and the circular structure */
+    tail = head;
+    for (list = st.runs[0].head; list; list = list->next) {
+        tail->next = list;
+        list->prev = tail;
+        tail = list;
     }
-    final_merge(priv, all_run, cmp);
-    run = list_first_entry(&all_run->head, struct run, list);
-    list_splice(&run->head, head);
-    free_runs_queue(all_run);
+    tail->next = head;
+    head->prev = tail;
 }
@@ -0,0 +1,11 @@
+# Commands of compiled.qtrc, made by scripts/compile-trace.py
+new
+ih dolphin
+ih   bear
+
+it gerbil 3
+rh bear
+rt gerbil
+rh dolphin
+size
+free
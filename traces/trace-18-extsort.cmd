@@ -0,0 +1,21 @@
+# Test external sort, which spills runs to a temporary file and merges them
+option fail 0
+option malloc 0
+new
+ih RAND 5000
+it gerbil 1000
+extsort 20000
+option descend 1
+extsort 20000
+option descend 0
+free
+new
+ih RAND 5000
+extsort 20000 /dev/null
+# Values not merged back yet are lost when the merge fails
+ih RAND 5000
+option malloc 100
+extsort 20000
+option malloc 0
+expect 1
+free
@@ -0,0 +1,8 @@
+# Test replay of traces compiled by scripts/compile-trace.py
+option fail 0
+option malloc 0
+source traces/compiled.qtrc
+# Copies of it whose header, then first record, claim more than the file holds
+source traces/compiled-bad-header.qtrc
+source traces/compiled-bad-record.qtrc
+expect 2
@@ -0,0 +1,26 @@
+# Test repeat blocks and variables
+option fail 0
+option malloc 0
+new
+set animal gerbil
+set animal $animal
+repeat 2 i {
+  repeat 3 {
+    it $animal
+  }
+  set last $i
+  ih $last
+}
+rh 1
+rh 0
+repeat 6 {
+  rh gerbil
+}
+size
+# Misspelled variables are errors, in blocks too
+ih $animals
+repeat 2 {
+  ih $animals
+}
+expect 3
+free
@@ -0,0 +1,16 @@
+# Test random operation mixes of the workload command
+option fail 0
+option malloc 0
+new
+workload 5000
+workload 2000 ih=40,it=40,rh=10,rt=10,sort=1,dedup=1,reverse=1 1-64 7
+workload 1000 rh=1,rt=1
+# Removals only stop once they have emptied the queue
+workload 5000 rh=1,rt=1
+free
+# Mixes of unknown operations or of no weight are errors
+new
+workload 100 ih=1,push=1
+workload 100 ih=0
+expect 2
+free
@@ -0,0 +1,20 @@
+# Test latency statistics of queue operations
+option fail 0
+option malloc 0
+new
+ih RAND 1000
+it gerbil 100
+rh
+rt gerbil
+sort
+reverse
+stats
+stats reset
+# Workloads report their own latencies instead
+workload 1000
+stats
+size
+stats
+stats clear
+expect 1
+free
@@ -2,18 +2,39 @@
  * MIT License.
  */
 
-#include <arpa/inet.h> /* inet_ntoa */
+/* accept4() and memmem() are GNU extensions */
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "list.h"
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
-#define MAXLINE 1024 /* max length of a line */
-#define BUFSIZE 1024
+#define MAXLINE 1024 /* max length of a command */
+#define BUFSIZE 8192 /* max length of a request, headers included */
+#define MAX_EVENTS 64
+/* A connection is not read while it has this many commands queued or
+ * running, or this many bytes of responses unsent, so a client pipelining
+ * requests without reading the responses cannot take up unbounded memory.
+ */
+#define MAX_PENDING 64
+#define MAX_UNSENT (16 * BUFSIZE)
 
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
@@ -23,142 +44,232 @@
 #define TCP_CORK TCP_NOPUSH
 #endif
 
-static int server_fd;
+/* The server runs on worker threads, each with its own epoll instance and
+ * connections, which all accept from the listening socket.  A worker reads
+ * and parses requests, and hands their commands to the interpreter thread,
+ * the one running the console, through a lock-free queue.  Once run, a
+ * command comes back with its response through the queue of the worker
+ * owning its connection, which writes it out.  Only that worker ever
+ * touches a connection.
+ */
 
-typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
+/* Intrusive multiple-producer single-consumer queue.  Pushing is a single
+ * atomic exchange.  Popping is lock-free for the one consumer, but finds the
+ * queue empty while the push of the last node is half done; the producer
+ * wakes the consumer once it is complete.  All operations are sequentially
+ * consistent, which mailbox_take() relies on.
+ */
+typedef struct mpsc_node {
+    struct mpsc_node *_Atomic next;
+} mpsc_node_t;
 
 typedef struct {
-    char filename[512];
-    off_t offset; /* for support Range */
-    size_t end;
-} http_request_t;
+    mpsc_node_t *_Atomic head; /* last pushed */
+    mpsc_node_t *tail;         /* next to pop, owned by the consumer */
+    mpsc_node_t stub;          /* keeps the queue non-empty */
+} mpsc_queue_t;
 
-static void rio_readinitb(rio_t *rp, int fd)
+static void mpsc_init(mpsc_queue_t *q)
 {
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
 }
 
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
- */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
-    }
-
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
-    return cnt;
+static void mpsc_push(mpsc_queue_t *q, mpsc_node_t *node)
+{
+    atomic_store(&node->next, NULL);
+    mpsc_node_t *prev = atomic_exchange(&q->head, node);
+    atomic_store(&prev->next, node);
 }
 
-static ssize_t writen(int fd, void *usrbuf, size_t n)
+static mpsc_node_t *mpsc_pop(mpsc_queue_t *q)
 {
-    size_t nleft = n;
-    char *bufp = usrbuf;
+    mpsc_node_t *tail = q->tail;
+    mpsc_node_t *next = atomic_load(&tail->next);
+
+    if (tail == &q->stub) {
+        if (!next)
+            return NULL;
+        q->tail = tail = next;
+        next = atomic_load(&tail->next);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
 
-    while (nleft > 0) {
-        ssize_t nwritten = write(fd, bufp, nleft);
-        if (nwritten <= 0) {
-            if (errno == EINTR) { /* interrupted by sig handler return */
-                nwritten = 0;     /* and call write() again */
-            } else
-                return -1; /* errorno set by write() */
-        }
-        nleft -= nwritten;
-        bufp += nwritten;
+    /* tail is the last node, unless a push is half done */
+    if (tail != atomic_load(&q->head))
+        return NULL;
+    mpsc_push(q, &q->stub);
+    next = atomic_load(&tail->next);
+    if (next) {
+        q->tail = next;
+        return tail;
     }
-    return n;
+    return NULL;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+/* A queue whose consumer sleeps in epoll_wait() on an eventfd.  Producers
+ * only write to the eventfd when the consumer found the queue empty.
+ */
+typedef struct {
+    mpsc_queue_t queue;
+    int efd;
+    atomic_bool idle;
+} mailbox_t;
+
+static bool mailbox_init(mailbox_t *box)
 {
-    char c, *bufp = usrbuf;
+    mpsc_init(&box->queue);
+    atomic_init(&box->idle, false);
+    box->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return box->efd >= 0;
+}
 
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
-    }
-    *bufp = 0;
-    return n;
+static void mailbox_wake(mailbox_t *box)
+{
+    uint64_t one = 1;
+    ssize_t ret = write(box->efd, &one, sizeof(one));
+    (void) ret;
 }
 
-void web_send(int out_fd, char *buf)
+static void mailbox_post(mailbox_t *box, mpsc_node_t *node)
 {
-    writen(out_fd, buf, strlen(buf));
+    mpsc_push(&box->queue, node);
+    if (atomic_exchange(&box->idle, false))
+        mailbox_wake(box);
 }
 
-int web_open(int port)
+/* Pop the next node.  When there is none, the consumer is marked idle, so
+ * the next post wakes it up.
+ */
+static mpsc_node_t *mailbox_take(mailbox_t *box)
 {
-    int listenfd, optval = 1;
-    struct sockaddr_in serveraddr;
+    mpsc_node_t *node = mpsc_pop(&box->queue);
+
+    if (node)
+        return node;
+    atomic_store(&box->idle, true);
+    /* A post completed before idle was set did not wake anyone */
+    node = mpsc_pop(&box->queue);
+    if (node)
+        atomic_store(&box->idle, false);
+    return node;
+}
 
-    /* Create a socket descriptor */
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        return -1;
+/* Reset the eventfd after a wakeup */
+static void mailbox_clear(mailbox_t *box)
+{
+    uint64_t count;
+    ssize_t ret = read(box->efd, &count, sizeof(count));
+    (void) ret;
+}
 
-    /* Eliminates "Address already in use" error from bind. */
-    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *) &optval,
-                   sizeof(int)) < 0)
-        return -1;
+typedef struct web_worker web_worker_t;
 
-    // 6 is TCP's protocol number
-    // enable this, much faster : 4000 req/s -> 17000 req/s
-    if (setsockopt(listenfd, IPPROTO_TCP, TCP_CORK, (const void *) &optval,
-                   sizeof(int)) < 0)
-        return -1;
+/* A client connection.  Requests are parsed as soon as they are complete, so
+ * several may be queued at once when the client pipelines them.
+ */
+typedef struct {
+    int fd;
+    web_worker_t *worker; /* owner of the connection */
+    char in[BUFSIZE];     /* bytes received and not parsed yet */
+    size_t in_len;
+    char *out; /* bytes of responses not sent yet */
+    size_t out_len, out_cap;
+    int pending;  /* commands queued or running */
+    bool closing; /* no more requests: close once answered */
+    bool dead;    /* peer gone: drop responses, release when idle */
+    bool corked;  /* TCP_CORK is set */
+    struct list_head list;
+} web_conn_t;
+
+/* A command parsed from a request, on its way to the interpreter and back */
+typedef struct {
+    mpsc_node_t node;
+    web_conn_t *conn;
+    bool keep_alive;
+    char *resp; /* the response, once the command has run */
+    size_t resp_len;
+    char line[MAXLINE];
+} web_cmd_t;
+
+struct web_worker {
+    pthread_t thread;
+    int epoll_fd;
+    mailbox_t answers; /* commands with their response */
+    struct list_head conns;
+};
 
-    /* Listenfd will be an endpoint for all requests to port
-       on any IP address for this host */
-    memset(&serveraddr, 0, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serveraddr.sin_port = htons((unsigned short) port);
-    if (bind(listenfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0)
-        return -1;
+static int server_fd;
+static web_worker_t workers[WEB_MAX_WORKERS];
+static int nworkers;
+static atomic_bool stopping;
 
-    /* Make it a listening socket ready to accept connection requests */
-    if (listen(listenfd, LISTENQ) < 0)
-        return -1;
+/* Commands for the interpreter, and its epoll instance waiting for them and
+ * for standard input
+ */
+static mailbox_t commands;
+static int epoll_fd = -1;
+static bool stdin_polled;
 
-    server_fd = listenfd;
+/* Tags of the listening socket, standard input and the eventfd of a mailbox
+ * in epoll events, which otherwise carry the connection
+ */
+static const char listen_tag, stdin_tag, wake_tag;
 
-    return listenfd;
+/* Command handed to the interpreter, answered on the next call */
+static web_cmd_t *cmd_running;
+
+/* Output of the running command, the body of its response */
+static char *body;
+static size_t body_len, body_cap;
+
+void web_vprintf(const char *fmt, va_list ap)
+{
+    va_list copy;
+    int n;
+
+    if (!cmd_running)
+        return;
+
+    va_copy(copy, ap);
+    n = vsnprintf(body ? body + body_len : NULL, body_cap - body_len, fmt,
+                  copy);
+    va_end(copy);
+    if (n < 0)
+        return;
+
+    if (body_len + n >= body_cap) {
+        size_t cap = body_cap ? body_cap : BUFSIZE;
+        while (cap <= body_len + n)
+            cap *= 2;
+        char *grown = realloc(body, cap);
+        /* Output that does not fit is left out */
+        if (!grown)
+            return;
+        body = grown;
+        body_cap = cap;
+        vsnprintf(body + body_len, body_cap - body_len, fmt, ap);
+    }
+    body_len += n;
+}
+
+void web_printf(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    web_vprintf(fmt, ap);
+    va_end(ap);
+}
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
 }
 
 static void url_decode(char *src, char *dest, int max)
@@ -166,7 +277,7 @@ static void url_decode(char *src, char *dest, int max)
     char *p = src;
     char code[3] = {0};
     while (*p && --max) {
-        if (*p == '%') {
+        if (*p == '%' && p[1] && p[2]) {
             memcpy(code, ++p, 2);
             *dest++ = (char) strtoul(code, NULL, 16);
             p += 2;
@@ -177,94 +288,592 @@ static void url_decode(char *src, char *dest, int max)
     *dest = '\0';
 }
 
-static void parse_request(int fd, http_request_t *req)
-{
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    req->offset = 0;
-    req->end = 0; /* default */
-
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
+/* Give up on a connection.  It is released by conn_put() once no command
+ * of its requests is queued.
+ */
+static void conn_drop(web_conn_t *conn)
+{
+    if (conn->dead)
+        return;
+    conn->dead = true;
+    conn->out_len = 0;
+    epoll_ctl(conn->worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+}
+
+static void conn_release(web_conn_t *conn)
+{
+    list_del(&conn->list);
+    close(conn->fd);
+    free(conn->out);
+    free(conn);
+}
+
+static void conn_put(web_conn_t *conn)
+{
+    if (conn->dead && !conn->pending)
+        conn_release(conn);
+}
+/* Cork the connection while responses are coming in a row, so they share
+ * segments.  Uncorking pushes out what is left at once, instead of when the
+ * cork times out after 200 ms.
+ */
+static void conn_cork(web_conn_t *conn, bool on)
+{
+    int optval = on;
+
+    if (conn->corked != on &&
+        !setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval)))
+        conn->corked = on;
+}
+
+static bool conn_throttled(const web_conn_t *conn)
+{
+    return conn->pending >= MAX_PENDING || conn->out_len >= MAX_UNSENT;
+}
+
+/* Update the events to wait for on a live connection */
+static void conn_watch(web_conn_t *conn)
+{
+    struct epoll_event ev = {.data.ptr = conn};
+
+    if (!conn->closing && !conn_throttled(conn))
+        ev.events |= EPOLLIN;
+    if (conn->out_len)
+        ev.events |= EPOLLOUT;
+    epoll_ctl(conn->worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static bool conn_parse(web_conn_t *conn);
+
+/* Send as much of the pending output as the socket takes.  Close the
+ * connection once everything owed to a closing client is out.
+ */
+static void conn_flush(web_conn_t *conn)
+{
+    size_t sent = 0;
+
+    while (sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + sent, conn->out_len - sent,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            conn_drop(conn);
+            return;
+        }
+        sent += n;
+    }
+    memmove(conn->out, conn->out + sent, conn->out_len - sent);
+    conn->out_len -= sent;
+
+    /* Requests read before the connection was throttled */
+    if (!conn->closing && conn->in_len && !conn_throttled(conn) &&
+        !conn_parse(conn)) {
+        conn_drop(conn);
+        return;
+    }
+    if (!conn->out_len && !conn->pending)
+        conn_cork(conn, false);
+
+    if (conn->closing && !conn->pending && !conn->out_len) {
+        conn_drop(conn);
+        return;
+    }
+    conn_watch(conn);
+}
+
+static bool conn_append(web_conn_t *conn, const char *data, size_t len)
+{
+    if (conn->out_len + len > conn->out_cap) {
+        size_t cap = conn->out_cap ? conn->out_cap : BUFSIZE;
+        while (cap < conn->out_len + len)
+            cap *= 2;
+        char *grown = realloc(conn->out, cap);
+        if (!grown)
+            return false;
+        conn->out = grown;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return true;
+}
+
+/* Write out the response of a command, on the thread of the worker */
+static void conn_answer(web_cmd_t *cmd)
+{
+    web_conn_t *conn = cmd->conn;
+
+    conn->pending--;
+    if (!conn->dead) {
+        /* More pipelined requests of this client are queued */
+        if (conn->pending)
+            conn_cork(conn, true);
+        if (cmd->resp && conn_append(conn, cmd->resp, cmd->resp_len))
+            conn_flush(conn);
+        else
+            conn_drop(conn);
+    }
+    conn_put(conn);
+    free(cmd->resp);
+    free(cmd);
+}
+
+/* Send the command handed out by the previous call, which has run by now,
+ * back to its worker with the response.  A response that cannot be
+ * allocated is left NULL, which drops the connection.
+ */
+static void finish_running(void)
+{
+    web_cmd_t *cmd = cmd_running;
+    char header[128];
+
+    if (!cmd)
+        return;
+    cmd_running = NULL;
+
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Content-Length: %zu\r\n"
+                       "%s\r\n",
+                       body_len,
+                       cmd->keep_alive ? "" : "Connection: close\r\n");
+    cmd->resp = malloc(len + body_len);
+    if (cmd->resp) {
+        memcpy(cmd->resp, header, len);
+        memcpy(cmd->resp + len, body, body_len);
+        cmd->resp_len = len + body_len;
+    }
+    body_len = 0;
+    mailbox_post(&cmd->conn->worker->answers, &cmd->node);
+}
+
+/* Case-insensitive search of a header line "name: ..." in [p, end) */
+static const char *find_header(const char *p, const char *end, const char *name)
+{
+    size_t len = strlen(name);
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        if (eol - p > len && p[len] == ':' && !strncasecmp(p, name, len)) {
+            p += len + 1;
+            while (p < eol && (*p == ' ' || *p == '\t'))
+                p++;
+            return p;
         }
+        p = eol + 1;
     }
+    return NULL;
+}
+
+/* Turn the request line into a command: "GET /it/1 HTTP/1.1" is "it 1".
+ * Return false if there is no command.
+ */
+static bool request_command(const char *line, size_t len, char *cmd)
+{
+    char uri[MAXLINE];
+    const char *start = memchr(line, ' ', len);
+    size_t n = 0;
+
+    if (!start)
+        return false;
+    start++;
+    while (start + n < line + len && start[n] != ' ' && start[n] != '?' &&
+           start[n] != '\r' && n < MAXLINE - 1)
+        n++;
+    memcpy(uri, start, n);
+    uri[n] = '\0';
+
     char *filename = uri;
     if (uri[0] == '/') {
         filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
+        if (!*filename)
             filename = ".";
+    }
+    url_decode(filename, cmd, MAXLINE);
+
+    /* Change '/' to ' ' */
+    for (char *p = cmd; *p;) {
+        ++p;
+        if (*p == '/')
+            *p = ' ';
+    }
+    /* An empty command would read as input on the console */
+    return *cmd;
+}
+
+/* Queue a command for every complete request in the input buffer.  Return
+ * false if the client sent something that cannot be a request.
+ */
+static bool conn_parse(web_conn_t *conn)
+{
+    size_t pos = 0;
+
+    while (!conn->closing && !conn_throttled(conn) && pos < conn->in_len) {
+        char *req = conn->in + pos;
+        size_t avail = conn->in_len - pos;
+        char *end = memmem(req, avail, "\r\n\r\n", 4);
+        size_t head_len;
+
+        if (end) {
+            head_len = end - req + 4;
+        } else if ((end = memmem(req, avail, "\n\n", 2))) {
+            head_len = end - req + 2;
         } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
+            break;
+        }
+
+        /* Skip a body, though commands never take one */
+        size_t body_len = 0;
+        const char *value = find_header(req, end, "Content-Length");
+        if (value)
+            body_len = strtoul(value, NULL, 10);
+        if (body_len > BUFSIZE || head_len + body_len > BUFSIZE)
+            return false;
+        if (head_len + body_len > avail)
+            break;
+
+        const char *eol = memchr(req, '\n', end - req);
+        size_t line_len = eol ? (size_t) (eol - req) : (size_t) (end - req);
+
+        /* HTTP/1.1 keeps the connection unless told otherwise, and
+         * HTTP/1.0 closes it unless told otherwise.
+         */
+        bool keep_alive = !memmem(req, line_len, "HTTP/1.0", 8);
+        value = find_header(req, end, "Connection");
+        if (value && !strncasecmp(value, "close", 5))
+            keep_alive = false;
+        else if (value && !strncasecmp(value, "keep-alive", 10))
+            keep_alive = true;
+
+        web_cmd_t *cmd = malloc(sizeof(web_cmd_t));
+        if (!cmd)
+            return false;
+        if (!request_command(req, line_len, cmd->line)) {
+            free(cmd);
+            return false;
+        }
+        cmd->conn = conn;
+        cmd->keep_alive = keep_alive;
+        cmd->resp = NULL;
+        conn->pending++;
+        mailbox_post(&commands, &cmd->node);
+        if (!keep_alive)
+            conn->closing = true;
+
+        pos += head_len + body_len;
+    }
+
+    memmove(conn->in, conn->in + pos, conn->in_len - pos);
+    conn->in_len -= pos;
+    /* A full buffer holding no complete request never makes progress */
+    return conn->closing || conn_throttled(conn) || conn->in_len < BUFSIZE;
+}
+
+static void conn_read(web_conn_t *conn)
+{
+    for (;;) {
+        ssize_t n = read(conn->fd, conn->in + conn->in_len,
+                         BUFSIZE - conn->in_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n == 0) {
+            /* The client is done sending: answer what it asked for */
+            conn->closing = true;
+            if (!conn->pending && !conn->out_len)
+                conn_drop(conn);
+            else
+                conn_watch(conn);
+            return;
+        }
+        if (n < 0) {
+            conn_drop(conn);
+            return;
+        }
+        conn->in_len += n;
+        if (!conn_parse(conn)) {
+            conn_drop(conn);
+            return;
+        }
+        if (conn->closing || conn_throttled(conn)) {
+            conn_watch(conn);
+            return;
+        }
+    }
+}
+
+static void accept_all(web_worker_t *w)
+{
+    for (;;) {
+        int fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+
+        /* Responses are written whole, and batched with TCP_CORK, so
+         * Nagle's algorithm would only hold one back until the previous
+         * one is acknowledged.
+         */
+        int optval = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+        web_conn_t *conn = calloc(1, sizeof(web_conn_t));
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+        if (!conn || epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->worker = w;
+        list_add_tail(&conn->list, &w->conns);
+    }
+}
+
+static void *worker_run(void *arg)
+{
+    web_worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    web_conn_t *conn, *safe;
+    mpsc_node_t *node;
+
+    while (!atomic_load(&stopping)) {
+        while ((node = mailbox_take(&w->answers)))
+            conn_answer(container_of(node, web_cmd_t, node));
+
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &listen_tag) {
+                accept_all(w);
+            } else if (tag == &wake_tag) {
+                mailbox_clear(&w->answers);
+            } else {
+                conn = tag;
+                if (events[i].events & EPOLLERR)
+                    conn_drop(conn);
+                if (!conn->dead && (events[i].events & EPOLLOUT))
+                    conn_flush(conn);
+                if (!conn->dead && (events[i].events & EPOLLIN))
+                    conn_read(conn);
+                if (!conn->dead && (events[i].events & EPOLLHUP) &&
+                    !conn->pending)
+                    conn_drop(conn);
+                conn_put(conn);
             }
         }
     }
-    url_decode(filename, req->filename, MAXLINE);
+
+    /* Best effort to deliver the answer to the command ending the server.
+     * Commands still queued for the interpreter are released by it.
+     */
+    while ((node = mailbox_take(&w->answers)))
+        conn_answer(container_of(node, web_cmd_t, node));
+    list_for_each_entry_safe (conn, safe, &w->conns, list)
+        conn_release(conn);
+    return NULL;
 }
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+static bool worker_init(web_worker_t *w)
 {
-    http_request_t req;
-    parse_request(fd, &req);
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLEXCLUSIVE,
+        .data.ptr = (void *) &listen_tag,
+    };
+
+    INIT_LIST_HEAD(&w->conns);
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epoll_fd < 0)
+        return false;
+    if (!mailbox_init(&w->answers)) {
+        close(w->epoll_fd);
+        return false;
+    }
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0)
+        goto fail;
+    ev.events = EPOLLIN;
+    ev.data.ptr = (void *) &wake_tag;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->answers.efd, &ev) < 0)
+        goto fail;
+    return true;
+
+fail:
+    close(w->answers.efd);
+    close(w->epoll_fd);
+    return false;
+}
 
-    char *p = req.filename;
-    /* Change '/' to ' ' */
-    while (*p) {
-        ++p;
-        if (*p == '/')
-            *p = ' ';
+static void worker_free(web_worker_t *w)
+{
+    close(w->answers.efd);
+    close(w->epoll_fd);
+}
+
+/* Start up to n workers.  Signals are blocked in them, so that the alarm of
+ * the harness always interrupts the interpreter.
+ */
+static int start_workers(int n)
+{
+    sigset_t all, old;
+    int started = 0;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    atomic_store(&stopping, false);
+    while (started < n) {
+        web_worker_t *w = &workers[started];
+        if (!worker_init(w))
+            break;
+        if (pthread_create(&w->thread, NULL, worker_run, w)) {
+            worker_free(w);
+            break;
+        }
+        started++;
     }
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return started;
+}
+
+int web_open(int port, int threads)
+{
+    int listenfd, optval = 1;
+    struct sockaddr_in serveraddr;
+
+    /* Create a socket descriptor */
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    /* Eliminates "Address already in use" error from bind. */
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *) &optval,
+                   sizeof(int)) < 0)
+        return -1;
+
+    /* Listenfd will be an endpoint for all requests to port
+       on any IP address for this host */
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short) port);
+    if (bind(listenfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0)
+        return -1;
+
+    /* Make it a listening socket ready to accept connection requests */
+    if (listen(listenfd, LISTENQ) < 0)
+        return -1;
+
+    /* Connections are accepted until the backlog is drained */
+    if (!set_nonblocking(listenfd))
+        return -1;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0 || !mailbox_init(&commands))
+        return -1;
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = (void *) &wake_tag,
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, commands.efd, &ev) < 0)
+        return -1;
+
+    /* Regular files cannot be polled; they are always readable anyway */
+    ev.data.ptr = (void *) &stdin_tag;
+    stdin_polled = !epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
 
-    return ret;
+    server_fd = listenfd;
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > WEB_MAX_WORKERS)
+        threads = WEB_MAX_WORKERS;
+    nworkers = start_workers(threads);
+    if (!nworkers)
+        return -1;
+
+    return listenfd;
 }
 
+
+static int hand_out(mpsc_node_t *node, char *buf)
+{
+    cmd_running = container_of(node, web_cmd_t, node);
+    strcpy(buf, cmd_running->line);
+    return strlen(buf);
+}
+
+/* Wait for a command from either standard input or a web client.  Return
+ * the length of the command copied to buf, 0 if standard input is ready,
+ * and -1 on failure.
+ */
 int web_eventmux(char *buf)
 {
-    fd_set listenset;
+    struct epoll_event events[2];
+    bool stdin_ready = false;
+
+    finish_running();
 
-    FD_ZERO(&listenset);
-    FD_SET(STDIN_FILENO, &listenset);
-    int max_fd = STDIN_FILENO;
-    if (server_fd > 0) {
-        FD_SET(server_fd, &listenset);
-        max_fd = max_fd > server_fd ? max_fd : server_fd;
+    for (;;) {
+        mpsc_node_t *node = mailbox_take(&commands);
+        if (node)
+            return hand_out(node, buf);
+        if (stdin_ready)
+            return 0;
+
+        /* Without a way to wait for standard input, only check the clients */
+        int n = epoll_wait(epoll_fd, events, 2, stdin_polled ? -1 : 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        stdin_ready = !stdin_polled;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &stdin_tag)
+                stdin_ready = true;
+            else
+                mailbox_clear(&commands);
+        }
     }
-    int result = select(max_fd + 1, &listenset, NULL, NULL, NULL);
-    if (result < 0)
-        return -1;
+}
 
-    if (server_fd > 0 && FD_ISSET(server_fd, &listenset)) {
-        FD_CLR(server_fd, &listenset);
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        int web_connfd =
-            accept(server_fd, (struct sockaddr *) &clientaddr, &clientlen);
-
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-        strncpy(buf, p, strlen(p) + 1);
-        free(p);
-        close(web_connfd);
-        return strlen(buf);
+void web_close(void)
+{
+    mpsc_node_t *node;
+
+    if (epoll_fd < 0)
+        return;
+
+    /* The workers answer the running command before they exit */
+    finish_running();
+    atomic_store(&stopping, true);
+    for (int i = 0; i < nworkers; i++) {
+        mailbox_wake(&workers[i].answers);
+        pthread_join(workers[i].thread, NULL);
+        worker_free(&workers[i]);
     }
+    nworkers = 0;
+
+    /* Their connections are gone, and so are the commands still queued */
+    while ((node = mailbox_take(&commands)))
+        free(container_of(node, web_cmd_t, node));
+
+    free(body);
+    body = NULL;
+    body_len = body_cap = 0;
 
-    FD_CLR(STDIN_FILENO, &listenset);
-    return 0;
+    close(commands.efd);
+    close(server_fd);
+    close(epoll_fd);
+    server_fd = 0;
+    epoll_fd = -1;
 }
@@ -2,13 +2,25 @@
 #define TINYWEB_H
 
 #include <netinet/in.h>
+#include <stdarg.h>
 
-int web_open(int port);
+/* Most threads serving the web clients */
+#define WEB_MAX_WORKERS 64
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
-
-void web_send(int out_fd, char *buffer);
+/* Listen on port, with threads workers accepting connections and parsing
+ * requests.  Return the listening socket, or -1 on failure.
+ */
+int web_open(int port, int threads);
 
 int web_eventmux(char *buf);
 
+/* Append to the response of the command run for a web request.  Output of
+ * commands typed on the console is not captured.
+ */
+void web_vprintf(const char *fmt, va_list ap);
+void web_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Answer the running command and close the server and its connections */
+void web_close(void);
+
 #endif
@@ -0,0 +1,400 @@
+/* Load generator for the web server of qtest.
+ *
+ * Each thread keeps its share of the client connections busy through its own
+ * epoll instance, each connection sending the same GET request over and
+ * over, and the request rate is reported once all responses are in.  By
+ * default the connections are kept alive and may pipeline requests; with -C,
+ * every request opens a new connection and reads its response up to the end
+ * of the stream, which also works against servers that close the connection
+ * without Content-Length.
+ */
+
+/* memmem() and strcasestr() are GNU extensions */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 9999
+#define DEFAULT_CONNS 16
+#define DEFAULT_REQUESTS 10000
+#define DEFAULT_PATH "/size"
+#define BUFSIZE 8192
+#define MAX_EVENTS 64
+
+typedef struct bench bench_t;
+
+typedef struct {
+    int fd;
+    bench_t *bench;   /* thread driving the client */
+    int inflight;     /* requests sent and not answered */
+    bool closing;     /* the server closes after the current response */
+    char in[BUFSIZE]; /* bytes of responses not parsed yet */
+    size_t in_len;
+    char *out; /* bytes of requests not sent yet */
+    size_t out_len, out_cap;
+} client_t;
+
+struct bench {
+    pthread_t thread;
+    int epoll_fd;
+    client_t *clients;
+    int nconns;
+    long total, issued, answered, failed;
+};
+
+static struct sockaddr_in server;
+static const char *path = DEFAULT_PATH;
+static bool keep_alive = true;
+static int depth = 1;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool client_connect(client_t *c)
+{
+    bench_t *b = c->bench;
+    int one = 1;
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0)
+        return false;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *) &server, sizeof(server)) < 0 &&
+        errno != EINPROGRESS) {
+        close(c->fd);
+        return false;
+    }
+    c->inflight = 0;
+    c->closing = false;
+    c->in_len = 0;
+    c->out_len = 0;
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    if (epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        close(c->fd);
+        return false;
+    }
+    return true;
+}
+
+/* Queue requests until depth of them are in flight or all are issued */
+static bool client_fill(client_t *c)
+{
+    bench_t *b = c->bench;
+    char req[512];
+    int len = snprintf(req, sizeof(req),
+                       "GET %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n", path,
+                       keep_alive ? "" : "Connection: close\r\n");
+
+    while (b->issued < b->total && c->inflight < (keep_alive ? depth : 1)) {
+        if (c->out_len + len > c->out_cap) {
+            size_t cap = c->out_cap ? c->out_cap * 2 : 1024;
+            while (cap < c->out_len + len)
+                cap *= 2;
+            char *grown = realloc(c->out, cap);
+            if (!grown)
+                return false;
+            c->out = grown;
+            c->out_cap = cap;
+        }
+        memcpy(c->out + c->out_len, req, len);
+        c->out_len += len;
+        c->inflight++;
+        b->issued++;
+    }
+    return true;
+}
+
+static void client_close(client_t *c)
+{
+    bench_t *b = c->bench;
+
+    epoll_ctl(b->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    /* Requests the server will never answer */
+    b->failed += c->inflight;
+    c->inflight = 0;
+}
+
+/* Consume the complete responses in the input buffer.  At the end of the
+ * stream, a response without Content-Length is complete too.
+ */
+static void client_parse(client_t *c, bool eof)
+{
+    bench_t *b = c->bench;
+    size_t pos = 0;
+
+    while (c->inflight && pos < c->in_len) {
+        char *resp = c->in + pos;
+        size_t avail = c->in_len - pos;
+        char *end = memmem(resp, avail, "\r\n\r\n", 4);
+        if (!end)
+            break;
+        *end = '\0';
+
+        size_t size = end + 4 - resp;
+        char *cl = strcasestr(resp, "\r\nContent-Length:");
+        if (cl) {
+            size += strtoul(cl + 17, NULL, 10);
+        } else if (eof) {
+            size = avail;
+        } else {
+            *end = '\r';
+            break;
+        }
+        if (size > avail) {
+            *end = '\r';
+            break;
+        }
+
+        if (strncmp(resp, "HTTP/1.1 200", 12) &&
+            strncmp(resp, "HTTP/1.0 200", 12))
+            b->failed++;
+        else
+            b->answered++;
+        if (strcasestr(resp, "\r\nConnection: close"))
+            c->closing = true;
+        c->inflight--;
+        pos += size;
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+}
+
+/* Drive a client after an event.  Return false if it is done for good. */
+static bool client_event(client_t *c, uint32_t events)
+{
+    bench_t *b = c->bench;
+
+    if (events & EPOLLIN) {
+        for (;;) {
+            ssize_t n = read(c->fd, c->in + c->in_len, BUFSIZE - c->in_len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN)
+                break;
+            if (n <= 0 || c->in_len + n == BUFSIZE) {
+                if (n > 0)
+                    c->in_len += n;
+                client_parse(c, true);
+                client_close(c);
+                break;
+            }
+            c->in_len += n;
+            client_parse(c, false);
+        }
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        client_close(c);
+    }
+
+    /* Start over on a new connection when the server hangs up */
+    if (c->fd >= 0 && (c->closing || !keep_alive) && !c->inflight)
+        client_close(c);
+    if (c->fd < 0) {
+        if (b->issued >= b->total)
+            return false;
+        if (!client_connect(c)) {
+            perror("connect");
+            return false;
+        }
+    }
+    if (!c->inflight && !client_fill(c))
+        return false;
+
+    while (c->out_len) {
+        ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EINPROGRESS ||
+                      errno == ENOTCONN))
+            break;
+        if (n < 0) {
+            client_close(c);
+            return b->issued < b->total ? client_event(c, 0) : false;
+        }
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+    struct epoll_event ev = {
+        .events = EPOLLIN | (c->out_len ? EPOLLOUT : 0),
+        .data.ptr = c,
+    };
+    epoll_ctl(b->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    return true;
+}
+
+static void *bench_run(void *arg)
+{
+    bench_t *b = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int active = 0;
+
+    for (int i = 0; i < b->nconns && b->issued < b->total; i++) {
+        if (!client_event(&b->clients[i], 0))
+            break;
+        active++;
+    }
+
+    while (active > 0 && b->answered + b->failed < b->total) {
+        int n = epoll_wait(b->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (!client_event(events[i].data.ptr, events[i].events))
+                active--;
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *cmd)
+{
+    printf("Usage: %s [-h] [-a ADDR] [-p PORT] [-c CONNS] [-n REQUESTS] "
+           "[-d DEPTH] [-t THREADS] [-C] [PATH]\n",
+           cmd);
+    printf("\t-h          Print this information\n");
+    printf("\t-a ADDR     Server address (default 127.0.0.1)\n");
+    printf("\t-p PORT     Server port (default %d)\n", DEFAULT_PORT);
+    printf("\t-c CONNS    Concurrent connections (default %d)\n",
+           DEFAULT_CONNS);
+    printf("\t-n REQUESTS Number of requests (default %d)\n",
+           DEFAULT_REQUESTS);
+    printf("\t-d DEPTH    Requests pipelined per connection (default 1)\n");
+    printf("\t-t THREADS  Threads driving the connections (default 1)\n");
+    printf("\t-C          Open a new connection for every request\n");
+    printf("\tPATH        Command to request (default %s)\n", DEFAULT_PATH);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *addr = "127.0.0.1";
+    int port = DEFAULT_PORT, nconns = DEFAULT_CONNS, nthreads = 1;
+    long total = DEFAULT_REQUESTS;
+    int c;
+
+    while ((c = getopt(argc, argv, "ha:p:c:n:d:t:C")) != -1) {
+        switch (c) {
+        case 'a':
+            addr = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'n':
+            total = atol(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'C':
+            keep_alive = false;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+    if (nconns < 1 || depth < 1 || total < 1 || nthreads < 1) {
+        fprintf(stderr,
+                "Connections, depth, requests and threads must be positive\n");
+        return 1;
+    }
+    /* Every thread needs a connection */
+    if (nthreads > nconns)
+        nthreads = nconns;
+
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &server.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address '%s'\n", addr);
+        return 1;
+    }
+    bench_t *benches = calloc(nthreads, sizeof(bench_t));
+    client_t *clients = calloc(nconns, sizeof(client_t));
+    if (!benches || !clients) {
+        perror("webbench");
+        return 1;
+    }
+
+    /* Share the connections and requests evenly between the threads */
+    for (int t = 0, first = 0; t < nthreads; t++) {
+        bench_t *b = &benches[t];
+        b->nconns = nconns / nthreads + (t < nconns % nthreads);
+        b->total = total / nthreads + (t < total % nthreads);
+        b->clients = clients + first;
+        first += b->nconns;
+        for (int i = 0; i < b->nconns; i++) {
+            b->clients[i].fd = -1;
+            b->clients[i].bench = b;
+        }
+        b->epoll_fd = epoll_create1(0);
+        if (b->epoll_fd < 0) {
+            perror("epoll_create1");
+            return 1;
+        }
+    }
+
+    double start = now();
+    for (int t = 1; t < nthreads; t++) {
+        if (pthread_create(&benches[t].thread, NULL, bench_run, &benches[t])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    bench_run(&benches[0]);
+    for (int t = 1; t < nthreads; t++)
+        pthread_join(benches[t].thread, NULL);
+    double elapsed = now() - start;
+
+    long answered = 0, failed = 0;
+    for (int t = 0; t < nthreads; t++) {
+        answered += benches[t].answered;
+        failed += benches[t].failed;
+        close(benches[t].epoll_fd);
+    }
+    printf("%ld requests, %ld failed, %d connections, %d threads, %s, "
+           "depth %d\n",
+           answered + failed, failed, nconns, nthreads,
+           keep_alive ? "keep-alive" : "close", keep_alive ? depth : 1);
+    printf("%.3f s, %.0f requests/s\n", elapsed, answered / elapsed);
+
+    for (int i = 0; i < nconns; i++) {
+        if (clients[i].fd >= 0)
+            close(clients[i].fd);
+        free(clients[i].out);
+    }
+    free(clients);
+    free(benches);
+    return failed ? 1 : 0;
+}